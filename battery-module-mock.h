@@ -0,0 +1,242 @@
+/**
+ * Emulation of the embedded controller of the Acer Switch 11 laptop.
+ *
+ * If the module is built with `make MOCK_EC=1`, all I2C transfers of the driver
+ * are answered by this emulation instead of the real batteries and AC adapters.
+ * The emulated registers can be changed via debugfs and a latency as well as a
+ * failure rate can be injected, so that the driver can be tested and measured
+ * (e.g. with the debugfs statistics or the tracepoints) without the hardware.
+ *
+ * Author: Julian Frimmel <julian.frimmel@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef BATTERY_MODULE_MOCK_H
+#define BATTERY_MODULE_MOCK_H
+
+#include <linux/random.h>
+
+/** The latency of every emulated transfer in micro seconds */
+static unsigned int mock_latency_us;
+module_param(mock_latency_us, uint, 0644);
+MODULE_PARM_DESC(mock_latency_us, "Latency of an emulated I2C transfer in us");
+
+/** The probability of an emulated transfer to fail in per mille */
+static unsigned int mock_failure_permille;
+module_param(mock_failure_permille, uint, 0644);
+MODULE_PARM_DESC(mock_failure_permille,
+    "Probability of an emulated I2C transfer to fail (NACK) in per mille");
+
+/**
+ * The number of emulated transfers, which started while another transfer of the
+ * driver was still running. The bus arbitration of the driver should keep this
+ * at 0, since the batteries on one bus share the arbiter.
+ */
+static unsigned int mock_concurrent_transfers;
+module_param(mock_concurrent_transfers, uint, 0444);
+MODULE_PARM_DESC(mock_concurrent_transfers,
+    "Number of emulated I2C transfers overlapping another one (read-only)");
+static atomic_t mock_ec_active_transfers = ATOMIC_INIT(0);
+
+/**
+ * The state of an emulated embedded controller.
+ *
+ * There is one embedded controller per battery instance, which answers at the
+ * addresses of the layout of that instance. The defaults describe a discharging
+ * battery at 80% with 1 A.
+ */
+struct mock_ec {
+    u8 status;
+    u16 energy;
+    u16 voltage;
+    u16 rate;
+    u8 ac_adapter;
+
+    /** The register address of the next read from the battery/AC adapter */
+    u8 battery_pointer;
+    u8 ac_adapter_pointer;
+};
+static struct mock_ec mock_ecs[BATTERY_INSTANCES_MAX] = {
+    [0 ... BATTERY_INSTANCES_MAX - 1] = {
+        .status = 0x01,
+        .energy = 3000,
+        .voltage = 7600,
+        .rate = 0x10000 - 1000,
+        .ac_adapter = 0x00
+    }
+};
+static DEFINE_MUTEX(mock_ec_lock);
+
+/**
+ * Find the emulated embedded controller answering at an address of a bus.
+ *
+ * `battery` is set, if the address is the one of the battery (and not of the
+ * AC adapter). A battery created by hand at the default address on a bus, that
+ * is not used by any instance, is answered by the first controller. The
+ * function returns `NULL`, if there is no device at the address.
+ */
+static struct mock_ec *mock_ec_find(
+    const struct i2c_adapter *adapter,
+    const u16 addr,
+    bool *battery
+) {
+    unsigned int i;
+
+    for (i = 0; i < battery_instances_count; i++) {
+        const struct battery_layout *layout = &battery_instances[i].layout;
+
+        if (layout->bus != adapter->nr)
+            continue;
+        if (addr == layout->battery_address || addr == layout->ac_adapter_address) {
+            *battery = addr == layout->battery_address;
+            return &mock_ecs[i];
+        }
+    }
+
+    if (addr != BATTERY_I2C_ADDRESS && addr != AC_ADAPTER_I2C_ADDRESS)
+        return NULL;
+    *battery = addr == BATTERY_I2C_ADDRESS;
+    return &mock_ecs[0];
+}
+
+/** Read an emulated battery register */
+static u8 mock_ec_battery_register(const struct mock_ec *ec, const u8 reg) {
+    switch (reg) {
+    case BATTERY_REGISTER_STATUS:
+        return ec->status;
+    case BATTERY_REGISTER_ENERGY:
+        return ec->energy & 0xFF;
+    case BATTERY_REGISTER_ENERGY + 1:
+        return ec->energy >> 8;
+    case BATTERY_REGISTER_VOLTAGE:
+        return ec->voltage & 0xFF;
+    case BATTERY_REGISTER_VOLTAGE + 1:
+        return ec->voltage >> 8;
+    case BATTERY_REGISTER_RATE:
+        return ec->rate & 0xFF;
+    case BATTERY_REGISTER_RATE + 1:
+        return ec->rate >> 8;
+    default:
+        return 0x00;
+    }
+}
+
+/** Emulate a single I2C message to the battery */
+static int mock_ec_battery_message(struct mock_ec *ec, struct i2c_msg *msg) {
+    u16 i;
+
+    if (!(msg->flags & I2C_M_RD)) {
+        /* the "special" register access operation */
+        if (msg->len < 3 || msg->buf[0] != 0x02 || msg->buf[1] != 0x80)
+            return -EREMOTEIO;
+        ec->battery_pointer = msg->buf[2];
+        return 0;
+    }
+
+    for (i = 0; i < msg->len; i++)
+        msg->buf[i] = mock_ec_battery_register(ec, ec->battery_pointer++);
+    return 0;
+}
+
+/** Emulate a single I2C message to the AC adapter */
+static int mock_ec_ac_adapter_message(struct mock_ec *ec, struct i2c_msg *msg) {
+    u16 i;
+
+    if (!(msg->flags & I2C_M_RD)) {
+        if (msg->len < 1)
+            return -EREMOTEIO;
+        ec->ac_adapter_pointer = msg->buf[0];
+        return 0;
+    }
+
+    for (i = 0; i < msg->len; i++)
+        msg->buf[i] = ec->ac_adapter_pointer == AC_ADAPTER_REGISTER ?
+            ec->ac_adapter : 0x00;
+    return 0;
+}
+
+/**
+ * Emulate `i2c_transfer()` with the emulated embedded controller.
+ *
+ * The function returns the number of transferred messages on success and a
+ * negative error code otherwise (just like `i2c_transfer()`).
+ */
+static int ec_transfer(
+    struct i2c_adapter *adapter,
+    struct i2c_msg *msgs,
+    int num
+) {
+    const bool concurrent = atomic_inc_return(&mock_ec_active_transfers) > 1;
+    int ret = 0;
+    int i;
+
+    mutex_lock(&mock_ec_lock);
+    if (concurrent)
+        mock_concurrent_transfers++;
+    if (mock_latency_us)
+        usleep_range(mock_latency_us, mock_latency_us + mock_latency_us / 4);
+
+    if (mock_failure_permille && prandom_u32_max(1000) < mock_failure_permille)
+        ret = -ENXIO;
+    for (i = 0; i < num && !ret; i++) {
+        bool battery;
+        struct mock_ec *ec = mock_ec_find(adapter, msgs[i].addr, &battery);
+
+        if (!ec)
+            ret = -ENXIO;
+        else if (battery)
+            ret = mock_ec_battery_message(ec, &msgs[i]);
+        else
+            ret = mock_ec_ac_adapter_message(ec, &msgs[i]);
+    }
+    mutex_unlock(&mock_ec_lock);
+    atomic_dec(&mock_ec_active_transfers);
+
+    return ret ? ret : num;
+}
+
+/** Emulate `i2c_smbus_read_byte_data()` with the emulated embedded controller */
+static s32 ec_smbus_read_byte_data(const struct i2c_client *client, u8 reg) {
+    u8 value;
+    struct i2c_msg msgs[2] = {
+        { .addr = client->addr, .flags = 0, .len = 1, .buf = &reg },
+        { .addr = client->addr, .flags = I2C_M_RD, .len = 1, .buf = &value }
+    };
+    int ret;
+
+    ret = ec_transfer(client->adapter, msgs, ARRAY_SIZE(msgs));
+    return ret < 0 ? ret : value;
+}
+
+/** The emulated controller supports everything a real controller could */
+static inline int ec_check_functionality(
+    struct i2c_adapter *adapter,
+    u32 func
+) {
+    return 1;
+}
+
+/**
+ * Create the debugfs files to change the emulated registers of the embedded
+ * controller of the battery with the number `index`
+ */
+static void mock_ec_debugfs_init(struct dentry *parent, const unsigned int index) {
+    struct mock_ec *ec = &mock_ecs[index];
+    struct dentry *dir = debugfs_create_dir("mock", parent);
+
+    debugfs_create_x8("status", 0644, dir, &ec->status);
+    debugfs_create_u16("energy", 0644, dir, &ec->energy);
+    debugfs_create_u16("voltage", 0644, dir, &ec->voltage);
+    debugfs_create_x16("rate", 0644, dir, &ec->rate);
+    debugfs_create_x8("ac_adapter", 0644, dir, &ec->ac_adapter);
+}
+
+#endif /* BATTERY_MODULE_MOCK_H */
@@ -0,0 +1,214 @@
+#!/bin/sh
+#
+# Test and benchmark the module against the emulated embedded controller.
+#
+# Usage: battery-module-test.sh test|bench
+#
+# The module has to be built with `make MOCK_EC=1` (this is done by `make test`
+# and `make bench`) and the script has to be run as root with debugfs mounted.
+# The environment variables I2C_BUS (the bus of the emulated batteries, default
+# 1), BENCH_READS (the number of reads per benchmark, default 100) and
+# MOCK_LATENCY_US (the latency of an emulated transfer, default 0) configure
+# the script.
+#
+# Author: Julian Frimmel <julian.frimmel@gmail.com>
+#
+# This software is licensed under the terms of the GNU General Public
+# License version 2, as published by the Free Software Foundation, and
+# may be copied, distributed, and modified under those terms.
+
+set -eu
+
+MODULE=battery_module
+OBJECT=./battery-module.ko
+PARAMETERS=/sys/module/$MODULE/parameters
+SUPPLIES=/sys/class/power_supply
+DEBUGFS=/sys/kernel/debug/acer-switch-battery
+
+BUS=${I2C_BUS:-1}
+READS=${BENCH_READS:-100}
+LATENCY=${MOCK_LATENCY_US:-0}
+
+failures=0
+
+# Load the module with the given parameters and wait for the power supplies
+# of the given batteries (the module probes asynchronously)
+load() {
+    count=$1
+    shift
+    insmod "$OBJECT" mock_latency_us="$LATENCY" "$@"
+    trap unload EXIT
+
+    i=0
+    while [ "$i" -lt "$count" ]; do
+        wait_for "$SUPPLIES/BAT$i"
+        wait_for "$SUPPLIES/ADP$i"
+        i=$((i + 1))
+    done
+}
+
+unload() {
+    rmmod "$MODULE"
+}
+
+wait_for() {
+    for _ in $(seq 50); do
+        [ -e "$1" ] && return 0
+        sleep 0.1
+    done
+    echo "Timeout while waiting for $1" >&2
+    exit 1
+}
+
+# The debugfs directory of a battery
+debugfs() {
+    if [ "$1" -eq 0 ]; then
+        echo "$DEBUGFS"
+    else
+        echo "$DEBUGFS$1"
+    fi
+}
+
+# Print the difference of two dumps of a debugfs statistics file. The first
+# argument is the number of columns identifying a line, only the lines with a
+# changed counter are printed.
+counters_diff() {
+    awk -v keys="$1" '
+        function key(    k, i) {
+            k = $1
+            for (i = 2; i <= keys; i++)
+                k = k " " $i
+            return k
+        }
+        FNR == 1 { if (NR != FNR) print; next }
+        NR == FNR {
+            for (i = keys + 1; i <= NF; i++)
+                before[key(), i] = $i
+            next
+        }
+        {
+            line = key()
+            changed = 0
+            for (i = keys + 1; i <= NF; i++) {
+                difference = $i - before[key(), i]
+                line = line " " difference
+                if (difference)
+                    changed = 1
+            }
+            if (changed)
+                print line
+        }
+    ' "$2" "$3"
+}
+
+# Sum up a column of a debugfs statistics file
+counters_sum() {
+    awk -v column="$1" 'FNR > 1 { sum += $column } END { print sum + 0 }' "$2"
+}
+
+check() {
+    description=$1
+    shift
+    if "$@"; then
+        echo "PASS: $description"
+    else
+        echo "FAIL: $description"
+        failures=$((failures + 1))
+    fi
+}
+
+run_test() {
+    load 2 i2c_bus="$BUS,$BUS" battery_address=0x70,0x71 \
+        ac_adapter_address=0x30,0x31 ac_poll_max_ms=200 \
+        ttl_status_ms=0 ttl_energy_ms=0 ttl_voltage_ms=0 ttl_rate_ms=0
+
+    check "the emulated battery is discharging" \
+        [ "$(cat "$SUPPLIES/BAT0/status")" = Discharging ]
+    check "the snapshot can be read" \
+        [ "$(wc -c < "$SUPPLIES/BAT0/snapshot")" -gt 0 ]
+
+    voltage=$(cat "$SUPPLIES/BAT0/voltage_now")
+    echo 7000 > "$(debugfs 1)/mock/voltage"
+    check "a register change is visible at its battery" \
+        [ "$(cat "$SUPPLIES/BAT1/voltage_now")" != "$voltage" ]
+    check "a register change is not visible at other batteries" \
+        [ "$(cat "$SUPPLIES/BAT0/voltage_now")" = "$voltage" ]
+
+    echo 0x10 > "$(debugfs 1)/mock/ac_adapter"
+    sleep 1
+    check "a plugged AC adapter is online" \
+        [ "$(cat "$SUPPLIES/ADP1/online")" = 1 ]
+    check "the other AC adapters stay offline" \
+        [ "$(cat "$SUPPLIES/ADP0/online")" = 0 ]
+
+    # slow transfers, so that unarbitrated transfers would overlap
+    echo 2000 > "$PARAMETERS/mock_latency_us"
+    for battery in 0 1; do
+        for _ in $(seq 20); do
+            cat "$SUPPLIES/BAT$battery/uevent" > /dev/null
+        done &
+    done
+    wait
+    echo "$LATENCY" > "$PARAMETERS/mock_latency_us"
+    check "the batteries on one bus do not transfer at the same time" \
+        [ "$(cat "$PARAMETERS/mock_concurrent_transfers")" -eq 0 ]
+
+    errors=$(counters_sum 4 "$DEBUGFS/registers")
+    echo 1000 > "$PARAMETERS/mock_failure_permille"
+    cat "$SUPPLIES/BAT0/capacity" > /dev/null 2>&1 || true
+    echo 0 > "$PARAMETERS/mock_failure_permille"
+    check "failed transfers are counted" \
+        [ "$(counters_sum 4 "$DEBUGFS/registers")" -gt "$errors" ]
+
+    echo "$failures test(s) failed"
+    [ "$failures" -eq 0 ]
+}
+
+# Read a file of a battery BENCH_READS times and print the wall time per read
+# and the bus transfers and property latencies caused by the reads
+bench() {
+    name=$1
+    file=$2
+    dumps=$(mktemp -d)
+
+    cat "$DEBUGFS/registers" > "$dumps/registers.before"
+    cat "$DEBUGFS/property_latency" > "$dumps/latency.before"
+    start=$(date +%s%N)
+    for _ in $(seq "$READS"); do
+        cat "$file" > /dev/null
+    done
+    end=$(date +%s%N)
+    cat "$DEBUGFS/registers" > "$dumps/registers.after"
+    cat "$DEBUGFS/property_latency" > "$dumps/latency.after"
+
+    echo "$name: $READS reads, $(((end - start) / READS / 1000)) us per read"
+    counters_diff 1 "$dumps/registers.before" "$dumps/registers.after"
+    counters_diff 2 "$dumps/latency.before" "$dumps/latency.after"
+    echo
+    rm -r "$dumps"
+}
+
+run_bench() {
+    load 1 i2c_bus="$BUS" sampler_interval_ms=0 \
+        ttl_status_ms=0 ttl_energy_ms=0 ttl_voltage_ms=0 ttl_rate_ms=0
+
+    bench uevent "$SUPPLIES/BAT0/uevent"
+    for property in $(sed -n 's/^POWER_SUPPLY_\([A-Z_]*\)=.*/\1/p' \
+            "$SUPPLIES/BAT0/uevent" | tr 'A-Z' 'a-z'); do
+        [ -e "$SUPPLIES/BAT0/$property" ] || continue
+        bench "$property" "$SUPPLIES/BAT0/$property"
+    done
+}
+
+case "${1:-}" in
+test)
+    run_test
+    ;;
+bench)
+    run_bench
+    ;;
+*)
+    echo "Usage: $0 test|bench" >&2
+    exit 2
+    ;;
+esac
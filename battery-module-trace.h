@@ -0,0 +1,103 @@
+/**
+ * Tracepoints of the battery driver for the Acer Switch 11 laptop.
+ *
+ * The events can be used with ftrace, perf or bpftrace (event group
+ * "acer_switch_battery") and do not cost anything, if they are disabled.
+ *
+ * Author: Julian Frimmel <julian.frimmel@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM acer_switch_battery
+
+#if !defined(BATTERY_MODULE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define BATTERY_MODULE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/** A read of one or more contiguous battery registers */
+TRACE_EVENT(battery_register_read,
+    TP_PROTO(u8 reg, u16 len, int result, unsigned int tries, s64 duration_ns),
+    TP_ARGS(reg, len, result, tries, duration_ns),
+    TP_STRUCT__entry(
+        __field(u8, reg)
+        __field(u16, len)
+        __field(int, result)
+        __field(unsigned int, tries)
+        __field(s64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->reg = reg;
+        __entry->len = len;
+        __entry->result = result;
+        __entry->tries = tries;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("reg=0x%02X len=%u result=%d tries=%u duration=%lldns",
+        __entry->reg, __entry->len, __entry->result, __entry->tries,
+        __entry->duration_ns
+    )
+);
+
+/** The start of a query of a battery property */
+TRACE_EVENT(battery_property_enter,
+    TP_PROTO(int property),
+    TP_ARGS(property),
+    TP_STRUCT__entry(
+        __field(int, property)
+    ),
+    TP_fast_assign(
+        __entry->property = property;
+    ),
+    TP_printk("property=%d", __entry->property)
+);
+
+/** The end of a query of a battery property */
+TRACE_EVENT(battery_property_exit,
+    TP_PROTO(int property, int value, int result),
+    TP_ARGS(property, value, result),
+    TP_STRUCT__entry(
+        __field(int, property)
+        __field(int, value)
+        __field(int, result)
+    ),
+    TP_fast_assign(
+        __entry->property = property;
+        __entry->value = value;
+        __entry->result = result;
+    ),
+    TP_printk("property=%d value=%d result=%d",
+        __entry->property, __entry->value, __entry->result
+    )
+);
+
+/** A change of the AC adapter state */
+TRACE_EVENT(battery_ac_adapter_changed,
+    TP_PROTO(unsigned int online),
+    TP_ARGS(online),
+    TP_STRUCT__entry(
+        __field(unsigned int, online)
+    ),
+    TP_fast_assign(
+        __entry->online = online;
+    ),
+    TP_printk("online=%u", __entry->online)
+);
+
+#endif /* BATTERY_MODULE_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE battery-module-trace
+#include <trace/define_trace.h>
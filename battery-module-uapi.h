@@ -0,0 +1,201 @@
+/**
+ * Userspace interface of the battery driver for the Acer Switch 11 laptop.
+ *
+ * This header describes the binary layout of the data provided by the module
+ * to userspace and can be included by userspace programs as well.
+ *
+ * Author: Julian Frimmel <julian.frimmel@gmail.com>
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef BATTERY_MODULE_UAPI_H
+#define BATTERY_MODULE_UAPI_H
+
+#include <linux/types.h>
+
+/**
+ * The name of the character device providing the battery history.
+ *
+ * This is the device of the first battery, the devices of further batteries
+ * have the number of the battery appended (e.g. "acer_battery_history1").
+ */
+#define BATTERY_HISTORY_DEVICE "acer_battery_history"
+
+/** The version of the layout of the mapped battery history */
+#define BATTERY_HISTORY_VERSION 2
+
+/**
+ * A sample of the battery history.
+ *
+ * Reading from the history device returns an array of these samples, oldest
+ * first.
+ */
+struct battery_history_sample {
+    /** The time of the sample in ns (CLOCK_BOOTTIME) */
+    __u64 timestamp_ns;
+    /** The number of the sample, increased by one for every sample */
+    __u32 sequence;
+    /** The energy in mWh */
+    __u32 energy;
+    /** The voltage in mV */
+    __u32 voltage;
+    /** The (dis-)charging current in mA */
+    __u32 current_now;
+    /** The capacity in % */
+    __u32 capacity;
+    /** The status (POWER_SUPPLY_STATUS_*) */
+    __u8 status;
+    /** Whether the AC adapter is connected */
+    __u8 ac_online;
+    __u8 reserved[2];
+};
+
+/**
+ * The header of the mapped battery history.
+ *
+ * The history device can be mapped read-only as a whole: the first page holds
+ * this header, followed by `size` samples at `data_offset`. The sample with the
+ * sequence number `n` is stored at the index `n % size`, `size` is a power of
+ * two.
+ *
+ * The sequence numbers are free-running 32 bit numbers, which wrap around. So
+ * `data_head` can be loaded atomically by 32 and 64 bit readers alike, and all
+ * differences below have to be calculated modulo 2^32 (i.e. as `__u32`). Since
+ * `size` is a power of two, the index stays correct across the wrap around.
+ *
+ * All samples before `data_head` are complete. A reader, which wants to read
+ * the sample `n`, has to:
+ *
+ * 1. load `data_head` with acquire semantics (or load it followed by a read
+ *    barrier) and check, that `0 < data_head - n <= size`;
+ * 2. copy the sample;
+ * 3. issue a read barrier and load `data_head` again: if now
+ *    `data_head - n >= size`, the sample may have been overwritten during the
+ *    copy and has to be discarded.
+ *
+ * The `sequence` of a valid sample equals `n`.
+ */
+struct battery_history_header {
+    /** The version of this layout (BATTERY_HISTORY_VERSION) */
+    __u32 version;
+    /** The size of a sample in bytes */
+    __u32 sample_size;
+    /** The number of samples in the history */
+    __u32 size;
+    /** The offset of the first sample from the start of the mapping */
+    __u32 data_offset;
+    /** The sequence number of the next sample to be written */
+    __u32 data_head;
+};
+
+/**
+ * The name of the character device providing the battery events (with the
+ * number of the battery appended for all but the first one)
+ */
+#define BATTERY_EVENTS_DEVICE "acer_battery_events"
+
+/** The type of a battery event */
+enum battery_event_type {
+    /** The status register changed, `value` is the new register value */
+    BATTERY_EVENT_STATUS = 1,
+    /** The AC adapter was (dis-)connected, `value` is the new state */
+    BATTERY_EVENT_AC_ADAPTER = 2,
+    /** The capacity crossed a threshold, `value` is the new capacity in % */
+    BATTERY_EVENT_CAPACITY = 3,
+    /**
+     * The battery entered or left the low or critical level, `value` is the
+     * new capacity level (POWER_SUPPLY_CAPACITY_LEVEL_*)
+     */
+    BATTERY_EVENT_ALERT = 4
+};
+
+/**
+ * An event of the battery or the AC adapter.
+ *
+ * Reading from the events device returns an array of these events, oldest
+ * first. A read blocks until there is at least one new event (unless the device
+ * was opened with O_NONBLOCK) and the device can be polled for new events.
+ */
+struct battery_event {
+    /** The time of the event in ns (CLOCK_BOOTTIME) */
+    __u64 timestamp_ns;
+    /** The number of the event, increased by one for every event */
+    __u32 sequence;
+    /** The type of the event (enum battery_event_type) */
+    __u16 type;
+    __u16 reserved;
+    /** The new value */
+    __u32 value;
+    /** The value before the event */
+    __u32 previous;
+};
+
+/** The name of the binary sysfs attribute of the battery holding a snapshot */
+#define BATTERY_SNAPSHOT_ATTRIBUTE "snapshot"
+
+/** The version of the layout of the battery snapshot */
+#define BATTERY_SNAPSHOT_VERSION 1
+
+/** The maximum number of raw registers contained in a battery snapshot */
+#define BATTERY_SNAPSHOT_REGISTERS 32
+
+/** The values of the battery snapshot could not be updated */
+#define BATTERY_SNAPSHOT_STALE 0x01
+
+/**
+ * A snapshot of the battery.
+ *
+ * Reading the binary attribute `snapshot` of the battery (e.g.
+ * /sys/class/power_supply/BAT0/snapshot) returns the current snapshot with a
+ * single read. It is served from the cache of the module, so only outdated
+ * registers are read from the battery. Fields may be added at the end in later
+ * versions, which is indicated by `version` and `size`.
+ */
+struct battery_snapshot_dump {
+    /** The version of this layout (BATTERY_SNAPSHOT_VERSION) */
+    __u32 version;
+    /** The size of the snapshot in bytes */
+    __u32 size;
+    /** The time since the last refresh in ms */
+    __u32 age_ms;
+    /** Flags of the snapshot (BATTERY_SNAPSHOT_*) */
+    __u32 flags;
+    /** The status (POWER_SUPPLY_STATUS_*) */
+    __u32 status;
+    /** The energy in mWh */
+    __u32 energy;
+    /** The (learned) energy if full in mWh */
+    __u32 energy_full;
+    /** The voltage in mV */
+    __u32 voltage;
+    /** The (dis-)charging current in mA */
+    __u32 current_now;
+    /** The (dis-)charging rate in uW (current times voltage) */
+    __u32 rate;
+    /** The capacity in % */
+    __u32 capacity;
+    /** The capacity level (POWER_SUPPLY_CAPACITY_LEVEL_*) */
+    __u32 capacity_level;
+    /** The estimated time until the battery is empty/full in s */
+    __u32 time_to_empty;
+    __u32 time_to_full;
+    /** Whether the AC adapter is connected */
+    __u32 ac_online;
+    /** The address of the first raw register */
+    __u8 registers_first;
+    /** The number of valid raw registers */
+    __u8 registers_count;
+    __u8 reserved[2];
+    /** The raw contents of the registers, beginning at `registers_first` */
+    __u8 registers[BATTERY_SNAPSHOT_REGISTERS];
+};
+
+#endif /* BATTERY_MODULE_UAPI_H */
@@ -23,80 +23,175 @@
 #include <linux/kernel.h>
 #include <linux/power_supply.h>
 #include <linux/i2c.h>
-#include <linux/kthread.h>
+#include <linux/regmap.h>
+#include <linux/workqueue.h>
 #include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/dmi.h>
+
+#include "battery-module-uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "battery-module-trace.h"
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Julian Frimmel <julian.frimmel@gmail.com>");
 MODULE_DESCRIPTION("Module for fixing the battery on an Acer Switch 11 Laptop");
 MODULE_VERSION("1.0.0");
 
-/** The name that the battery should get in the sysfs */
-#define BATTERY_NAME "BAT0"
+/** The name that the battery should get in the sysfs (with the instance) */
+#define BATTERY_NAME "BAT%u"
 
-/** The name that the AC adapter should get in the sysfs */
-#define AC_ADAPTER_NAME "ADP0"
+/** The name that the AC adapter should get in the sysfs (with the instance) */
+#define AC_ADAPTER_NAME "ADP%u"
 
+/** The type of the I2C device of the battery, which the driver binds to */
+#define BATTERY_DEVICE_TYPE "acer-switch-battery"
 
-/** Bus number of the battery and the AC adapter (depends on used hardware) */
+
+/**
+ * The default bus number of the battery and the AC adapter, if neither the
+ * module parameters nor the DMI table describe the hardware
+ */
 #define I2C_BUS 1
 
-/** Bus address of the battery and the AC adapter (depends on used hardware) */
+/** The default bus address of the battery and the AC adapter */
 #define BATTERY_I2C_ADDRESS 0x70
 #define AC_ADAPTER_I2C_ADDRESS 0x30
 
+/** The maximum number of batteries handled by the module */
+#define BATTERY_INSTANCES_MAX 4
+
 #define BATTERY_REGISTER_STATUS 0xC1
 #define BATTERY_REGISTER_RATE 0xD0
 #define BATTERY_REGISTER_ENERGY 0xC2
 #define BATTERY_REGISTER_VOLTAGE 0xC6
 #define AC_ADAPTER_REGISTER 0x6F
 
+/** The range of addresses containing all registers of a battery snapshot */
+#define BATTERY_REGISTERS_FIRST BATTERY_REGISTER_STATUS
+#define BATTERY_REGISTERS_LAST (BATTERY_REGISTER_RATE + 1)
+#define BATTERY_REGISTERS_SIZE \
+    (BATTERY_REGISTERS_LAST - BATTERY_REGISTERS_FIRST + 1)
 
-/** The time between two samples of the AC adapter state in milli seconds */
-#define AC_ADAPTER_CHECK_RATE_MS 500
-
-/** The maximum energy stored in the battery in mWh */
-#define BATTERY_DEFAULT_FULL_ENERGY 37500
 
 /**
- * The I2C bus of the battery.
- *
- * This has to be global, since it is used inside the initialization and exit
- * functions. Since they are callbacks, no parameter can be used. The only other
- * way to share this information is this (module-global) variable.
+ * The default bounds of the time between two samples of the AC adapter state in
+ * milli seconds. The time is doubled with every sample without a change.
  */
-static struct i2c_adapter *i2c_bus;
+#define AC_ADAPTER_CHECK_RATE_MIN_MS 500
+#define AC_ADAPTER_CHECK_RATE_MAX_MS 8000
+
+/** The default maximum number of tries of a single I2C transfer */
+#define I2C_MAX_TRIES 5
+
+/** The default bounds of the back-off delay between two I2C tries in micro s */
+#define I2C_RETRY_DELAY_US 200
+#define I2C_RETRY_DELAY_MAX_US 5000
+
+/** The number of tries to read a consistent word with byte-wise reads */
+#define WORD_READ_MAX_TRIES 3
+
+/** The default time until a cached battery register is outdated in milli s */
+#define BATTERY_REGISTER_TTL_MS 1000
 
 /**
- * The I2C device of the battery/AC adapter.
- *
- * This has to be global, since it is used inside the initialization and exit
- * functions. Since they are callbacks, no parameter can be used. The only other
- * way to share this information is this (module-global) variable.
+ * The default number of failed refreshes in a row, after which the circuit
+ * breaker is opened, and the default time until the battery is probed again.
  */
-static struct i2c_client *battery_device;
-static struct i2c_client *ac_adapter_device;
+#define BATTERY_BREAKER_THRESHOLD 3
+#define BATTERY_BREAKER_COOLDOWN_MS 5000
 
-/** The I2C slave information for the device tree */
-static struct i2c_board_info __initdata battery_info[] = {
-    {I2C_BOARD_INFO("acer-switch-battery", BATTERY_I2C_ADDRESS)}
-};
-static struct i2c_board_info __initdata ac_adapter_info[] = {
-    {I2C_BOARD_INFO("acer-switch-AC", AC_ADAPTER_I2C_ADDRESS)}
-};
+/** The default time between two samples of the battery history in milli s */
+#define BATTERY_SAMPLER_INTERVAL_MS 10000
+
+/** The default time between two samples while the battery is low in milli s */
+#define BATTERY_SAMPLER_LOW_INTERVAL_MS 1000
 
+/** The default capacity in %, at and below which the battery is low */
+#define BATTERY_CAPACITY_LOW 15
+
+/** The default capacity in %, at and below which the battery is critical */
+#define BATTERY_CAPACITY_CRITICAL 5
+
+/** The default window of the averaged (dis-)charging rate in milli seconds */
+#define BATTERY_ESTIMATE_WINDOW_MS 60000
+
+/** The number of samples in the battery history (must be a power of two) */
+#define BATTERY_HISTORY_SIZE 1024
+
+/** The default minimum time between two battery uevents in milli seconds */
+#define BATTERY_UEVENT_INTERVAL_MS 10000
+
+/** The default change of the capacity in %, which triggers a battery uevent */
+#define BATTERY_UEVENT_CAPACITY_DELTA 5
+
+/** The default voltage in mV, below which the battery is (nearly) empty */
+#define BATTERY_UEVENT_VOLTAGE_MIN_MV 6800
+
+/** The number of events kept for the readers (must be a power of two) */
+#define BATTERY_EVENTS_SIZE 64
+
+/** The maximum number of capacity thresholds, which trigger an event */
+#define BATTERY_CAPACITY_THRESHOLDS_MAX 8
+
+/** The maximum energy stored in the battery in mWh */
+#define BATTERY_DEFAULT_FULL_ENERGY 37500
+
+/** The location of a battery and its AC adapter on the I2C buses */
+struct battery_layout {
+    int bus;
+    unsigned short battery_address;
+    unsigned short ac_adapter_address;
+};
 
 /**
- * The power supply "battery".
+ * A battery device instantiated by the module.
  *
- * This variable holds resource information about the registered power supply.
+ * The instance is the platform data of the device, so that the driver knows
+ * the address of the AC adapter and the number of the battery.
  */
-static struct power_supply *battery;
+struct battery_instance {
+    struct battery_layout layout;
+    /**
+     * The device, once it is instantiated. It is cleared, when the device is
+     * removed together with its bus. Protected by `battery_instances_lock`.
+     */
+    struct i2c_client *client;
+};
+
+/** The battery devices instantiated by the module (see `battery_instantiate()`) */
+static struct battery_instance battery_instances[BATTERY_INSTANCES_MAX];
+static unsigned int battery_instances_count;
+static DEFINE_MUTEX(battery_instances_lock);
+
 
 /** Available properties of the battery */
 static enum power_supply_property battery_properties[] = {
     POWER_SUPPLY_PROP_STATUS,
     POWER_SUPPLY_PROP_CAPACITY,
+    POWER_SUPPLY_PROP_CAPACITY_LEVEL,
     POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
     POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
     POWER_SUPPLY_PROP_VOLTAGE_NOW,
@@ -118,28 +213,18 @@ static int battery_get_property(
     union power_supply_propval*
 );
 
-/** The descriptor of the battery device */
+/**
+ * The descriptor of the battery device.
+ *
+ * Every instance uses a copy with its own name (see `BATTERY_NAME`).
+ */
 static const struct power_supply_desc battery_description = {
-        .name = BATTERY_NAME,
         .type = POWER_SUPPLY_TYPE_BATTERY,
         .properties = battery_properties,
         .num_properties = ARRAY_SIZE(battery_properties),
         .get_property = battery_get_property
 };
 
-/** The configuration of the battery device */
-static const struct power_supply_config battery_config = {};
-
-/** Holds the energy stored in the battery the last time it was full */
-static unsigned int battery_last_full_energy = 37500;
-
-
-/**
- * The power supply "AC adapter".
- *
- * This variable holds resource information about the registered power supply.
- */
-static struct power_supply *ac_adapter;
 
 /** Available properties of the mains plug */
 static enum power_supply_property ac_adapter_properties[] = {
@@ -152,259 +237,2260 @@ static int ac_adapter_get_property(
     union power_supply_propval*
 );
 
-/** The descriptor of the AC adapter device */
+/**
+ * The descriptor of the AC adapter device.
+ *
+ * Every instance uses a copy with its own name (see `AC_ADAPTER_NAME`).
+ */
 static const struct power_supply_desc ac_adapter_description = {
-        .name = AC_ADAPTER_NAME,
         .type = POWER_SUPPLY_TYPE_MAINS,
         .properties = ac_adapter_properties,
         .num_properties = ARRAY_SIZE(ac_adapter_properties),
         .get_property = ac_adapter_get_property
 };
 
-/** A list of all power supplies, that are supplied from the AC plug */
-static char *ac_adapter_to[] = {
-    BATTERY_NAME
+/**
+ * The time until a cached battery register is outdated ("time to live") in milli
+ * seconds.
+ *
+ * Properties are served from the cached register snapshot, as long as none of
+ * its registers is outdated. A refresh only reads the outdated registers. A
+ * value of 0 disables the cache for that register.
+ */
+static unsigned int ttl_status_ms = BATTERY_REGISTER_TTL_MS;
+module_param(ttl_status_ms, uint, 0644);
+MODULE_PARM_DESC(ttl_status_ms,
+    "Time until the cached status register is outdated in ms (0: no caching)");
+static unsigned int ttl_energy_ms = BATTERY_REGISTER_TTL_MS;
+module_param(ttl_energy_ms, uint, 0644);
+MODULE_PARM_DESC(ttl_energy_ms,
+    "Time until the cached energy register is outdated in ms (0: no caching)");
+static unsigned int ttl_voltage_ms = BATTERY_REGISTER_TTL_MS;
+module_param(ttl_voltage_ms, uint, 0644);
+MODULE_PARM_DESC(ttl_voltage_ms,
+    "Time until the cached voltage register is outdated in ms (0: no caching)");
+static unsigned int ttl_rate_ms = BATTERY_REGISTER_TTL_MS;
+module_param(ttl_rate_ms, uint, 0644);
+MODULE_PARM_DESC(ttl_rate_ms,
+    "Time until the cached rate register is outdated in ms (0: no caching)");
+
+/** The registers contained in a battery snapshot */
+enum battery_field {
+    BATTERY_FIELD_STATUS,
+    BATTERY_FIELD_ENERGY,
+    BATTERY_FIELD_VOLTAGE,
+    BATTERY_FIELD_RATE,
+
+    BATTERY_FIELDS
+};
+
+/** A bit mask containing all registers of a battery snapshot */
+#define BATTERY_FIELDS_ALL (BIT(BATTERY_FIELDS) - 1)
+
+/** The description of a register contained in a battery snapshot */
+struct battery_register {
+    u8 address;
+    /** The width of the register in bytes (little endian) */
+    u8 width;
+    /** Whether the register contains a two's complement value */
+    bool is_signed;
+    /** The factor to convert the raw value into the unit of the value */
+    unsigned int scale;
+    /** The time until the cached register is outdated */
+    const unsigned int *ttl_ms;
 };
 
 /**
- * The configuration of the AC adapter device.
+ * The registers contained in a battery snapshot.
  *
- * It contains the battery as a "supplicant". If the AC adapter changes, all
- * supplicants are also updated.
+ * This is the only place describing the semantics of the registers: all values
+ * are decoded by `battery_register_value()` according to this table.
  */
-static const struct power_supply_config ac_adapter_config = {
-    .supplied_to = ac_adapter_to,
-    .num_supplicants = ARRAY_SIZE(ac_adapter_to)
+static const struct battery_register battery_registers[BATTERY_FIELDS] = {
+    [BATTERY_FIELD_STATUS] = {
+        .address = BATTERY_REGISTER_STATUS,
+        .width = 1,
+        .scale = 1,
+        .ttl_ms = &ttl_status_ms
+    },
+    /* in units of 10 mWh */
+    [BATTERY_FIELD_ENERGY] = {
+        .address = BATTERY_REGISTER_ENERGY,
+        .width = 2,
+        .scale = 10,
+        .ttl_ms = &ttl_energy_ms
+    },
+    [BATTERY_FIELD_VOLTAGE] = {
+        .address = BATTERY_REGISTER_VOLTAGE,
+        .width = 2,
+        .scale = 1,
+        .ttl_ms = &ttl_voltage_ms
+    },
+    /* negative while discharging */
+    [BATTERY_FIELD_RATE] = {
+        .address = BATTERY_REGISTER_RATE,
+        .width = 2,
+        .is_signed = true,
+        .scale = 1,
+        .ttl_ms = &ttl_rate_ms
+    }
 };
 
-/** Holds the current state of the AD adapter. */
-static unsigned int ac_adapter_connected;
+/**
+ * The read plan of the battery registers.
+ *
+ * Every range of contiguous registers is read with a single burst read, so the
+ * number of ranges is the maximum number of bus round trips of a refresh. The
+ * ranges are checked against `battery_registers` at compile time (see
+ * `battery_read_plan_check()`). They are also the readable registers of the
+ * regmap.
+ */
+static const struct regmap_range battery_read_plan[] = {
+    /* status, energy and voltage */
+    regmap_reg_range(BATTERY_REGISTER_STATUS, BATTERY_REGISTER_VOLTAGE + 1),
+    /* rate */
+    regmap_reg_range(BATTERY_REGISTER_RATE, BATTERY_REGISTER_RATE + 1)
+};
 
-/** The thread that periodically checks the AC adapter connection status */
-static struct task_struct *ac_adapter_thread;
+/** Check, whether a register is entirely contained in a range of the plan */
+#define BATTERY_REGISTER_PLANNED(field, range) ( \
+    battery_registers[field].address >= \
+        battery_read_plan[range].range_min && \
+    battery_registers[field].address + battery_registers[field].width - 1 <= \
+        battery_read_plan[range].range_max)
 
 /**
- * Read a single byte from a battery register.
+ * Check the read plan at compile time.
  *
- * The "special" register access operation is used, i.e. 0x80 is written to the
- * slave first, then the required sub-register and the the read of the byte.
+ * Every register has to be covered by the plan, otherwise it would not be read
+ * by burst reads. Ranges, which could be merged into one, are rejected, so that
+ * no bus round trip is added by accident.
  */
-static u8 read_byte_register(const u8 reg) {
-    struct i2c_msg msg;
-    u8 bufo[8] = {0};
-    u8 value;
-    int ret;
-    int tries;
-    const int max_tries = 5;
+static inline void battery_read_plan_check(void) {
+    /* extend the checks below, if a register is added */
+    BUILD_BUG_ON(BATTERY_FIELDS != 4);
+    BUILD_BUG_ON(ARRAY_SIZE(battery_read_plan) != 2);
+
+    BUILD_BUG_ON(!BATTERY_REGISTER_PLANNED(BATTERY_FIELD_STATUS, 0));
+    BUILD_BUG_ON(!BATTERY_REGISTER_PLANNED(BATTERY_FIELD_ENERGY, 0));
+    BUILD_BUG_ON(!BATTERY_REGISTER_PLANNED(BATTERY_FIELD_VOLTAGE, 0));
+    BUILD_BUG_ON(!BATTERY_REGISTER_PLANNED(BATTERY_FIELD_RATE, 1));
+
+    BUILD_BUG_ON(battery_read_plan[1].range_min <=
+            battery_read_plan[0].range_max + 1);
+    BUILD_BUG_ON(battery_read_plan[0].range_min < BATTERY_REGISTERS_FIRST);
+    BUILD_BUG_ON(battery_read_plan[1].range_max > BATTERY_REGISTERS_LAST);
+}
 
-    bufo[0] = 0x02;
-    bufo[1] = 0x80;
-    bufo[2] = reg;
-    msg.addr = battery_device->addr;
-    msg.len = 5;
-    msg.flags = 0;
-    msg.buf = bufo;
-    for (tries = 0; tries < max_tries; tries++) {
-        ret = i2c_transfer(battery_device->adapter, &msg, 1);
-        if (ret == 1)
-            break;
-        printk(KERN_ERR "Battery module: Write to register 0x%02X failed "
-                "(Result: 0x%02X, try %d/%d)\n",
-                reg, ret, tries + 1, max_tries
-        );
-    }
-    if (ret != 1) return 0x00;
+/**
+ * A snapshot of the raw battery registers.
+ *
+ * All registers are stored alongside the time of their last read, so that all
+ * properties of one query are based on the same sample and no register has to
+ * be read twice.
+ */
+struct battery_snapshot {
+    /** The time of the last refresh (in jiffies) */
+    unsigned long timestamp;
+    /** Whether the snapshot was filled at least once */
+    bool valid;
+    /** Whether the values could not be updated (or are known to be outdated) */
+    bool stale;
+
+    /**
+     * The raw contents of the registers, indexed by the address relative to
+     * `BATTERY_REGISTERS_FIRST` (see `battery_register_value()`)
+     */
+    u8 raw[BATTERY_REGISTERS_SIZE];
+    /** The time of the last read of every register (in jiffies) */
+    unsigned long timestamps[BATTERY_FIELDS];
+
+    /** The values derived from the registers above */
+    struct battery_values {
+        unsigned int status;
+        /** The energy in mWh */
+        unsigned int energy;
+        /** The energy if full in mWh */
+        unsigned int energy_full;
+        /** The voltage in mV */
+        unsigned int voltage;
+        /** The current in mA */
+        unsigned int current_now;
+        /** The (dis-)charging rate in uW (mA * mV) */
+        unsigned int rate;
+        /** The averaged (dis-)charging rate in uW, used for the estimations */
+        unsigned int rate_average;
+        /** The capacity in % */
+        unsigned int capacity;
+        unsigned int capacity_level;
+        /** The estimated time until the battery is empty/full in s */
+        unsigned int time_to_empty;
+        unsigned int time_to_full;
+        /** The state of the AC adapter at the time of the refresh */
+        unsigned int ac_online;
+    } values;
+};
 
-    msg.addr = battery_device->addr;
-    msg.len = 1;
-    msg.flags = I2C_M_RD;
-    msg.buf = &value;
-    for (tries = 0; tries < max_tries; tries++) {
-        ret = i2c_transfer(battery_device->adapter, &msg, 1);
-        if (ret == 1)
-            break;
-        printk(KERN_ERR "Battery module: Read of register 0x%02X failed "
-                "(Result: 0x%02X, try %d/%d)\n",
-                reg, ret, tries + 1, max_tries
-        );
-    }
-    if (ret != 1) return 0x00;
+/**
+ * The number of refreshes of the cached snapshot and the result of the last
+ * one.
+ *
+ * Both are only changed by the holder of the snapshot lock. They are used to
+ * coalesce concurrent refreshes: a caller, that waited for the lock while
+ * another one refreshed the snapshot, uses that result instead of refreshing
+ * it again.
+ */
+struct battery_refresh {
+    unsigned long generation;
+    int result;
+};
 
-    return value;
-}
+/**
+ * The circuit breaker for the battery access.
+ *
+ * If the battery fails to respond `breaker_threshold` times in a row, the
+ * breaker is opened and the bus is not accessed by property queries, until a
+ * background probe after `breaker_cooldown_ms` succeeds.
+ */
+static unsigned int breaker_threshold = BATTERY_BREAKER_THRESHOLD;
+module_param(breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(breaker_threshold,
+    "Failed refreshes in a row, after which the last known values are served "
+    "(0 disables the circuit breaker)");
+static unsigned int breaker_cooldown_ms = BATTERY_BREAKER_COOLDOWN_MS;
+module_param(breaker_cooldown_ms, uint, 0644);
+MODULE_PARM_DESC(breaker_cooldown_ms,
+    "Time between two probes of an unresponsive battery in ms");
 
 /**
- * Read a single word from a battery register.
+ * The state of the circuit breaker.
  *
- * The LSB is the register address, the MSB is register address + 1.
+ * It is only changed by the holder of the snapshot lock, but `open` may be read
+ * without holding it.
  */
-static inline u16 read_word_register(const u8 reg) {
-    return (read_byte_register(reg + 1) << 8) | read_byte_register(reg);
-}
+struct battery_breaker {
+    /** The number of consecutive failed refreshes */
+    unsigned int failures;
+    /** Whether the bus must not be accessed by property queries */
+    bool open;
+};
 
+/** The number of buckets of a latency histogram */
+#define LATENCY_BUCKETS 24
 
-/** Read the current energy in mWh */
-static inline unsigned int battery_energy(void) {
-    return read_word_register(BATTERY_REGISTER_ENERGY) * 10;
-}
+/**
+ * A histogram of latencies.
+ *
+ * The buckets are logarithmic: bucket 0 counts latencies below 1 us, bucket n
+ * latencies from 2^(n-1) us up to 2^n us. The last bucket counts everything
+ * above as well.
+ */
+struct latency_histogram {
+    atomic_long_t buckets[LATENCY_BUCKETS];
+};
 
-/** Read the last full energy in mWh */
-static inline unsigned int battery_energy_full(void) {
-    return battery_last_full_energy;
-}
+/**
+ * Statistics about the bus usage of a battery, exposed via debugfs.
+ *
+ * The I2C counters are indexed by the (first) register of the transfer, the
+ * property counters by the index of the property in `battery_properties`.
+ */
+struct battery_stats {
+    struct dentry *dir;
+
+    struct {
+        atomic_long_t transfers;
+        atomic_long_t retries;
+        atomic_long_t failures;
+    } registers[256];
+    atomic_long_t properties[ARRAY_SIZE(battery_properties)];
+
+    /** The latency of `read_block_register()` */
+    struct latency_histogram register_latency;
+    /** The latency of `battery_get_property()` */
+    struct latency_histogram property_latency;
+    /** The latency of `ac_adapter_online()` including the wait for the bus */
+    struct latency_histogram ac_adapter_latency;
+    /** The number of failed reads of the AC adapter */
+    atomic_t ac_adapter_failures;
+};
 
-/** Read the current voltage in mV */
-static inline unsigned int battery_voltage(void) {
-    return read_word_register(BATTERY_REGISTER_VOLTAGE);
-}
+/**
+ * The time between two samples of the battery history in milli seconds.
+ *
+ * The sampler periodically takes a snapshot of the battery and records it in
+ * the history, which can be read in bulk from the history device. A value of 0
+ * disables the sampler.
+ */
+static unsigned int sampler_interval_ms = BATTERY_SAMPLER_INTERVAL_MS;
+
+static int sampler_interval_set(const char *value, const struct kernel_param *kp);
+static void battery_samplers_restart(void);
+static void ac_adapters_restart(void);
+
+static const struct kernel_param_ops sampler_interval_ops = {
+    .set = sampler_interval_set,
+    .get = param_get_uint
+};
+module_param_cb(sampler_interval_ms, &sampler_interval_ops,
+    &sampler_interval_ms, 0644);
+MODULE_PARM_DESC(sampler_interval_ms,
+    "Time between two samples of the battery history in ms (0 disables it)");
+
+/**
+ * The time between two samples in milli seconds, while the battery is low or
+ * critical and not charging.
+ *
+ * This allows to detect the critical level (and to raise an alert event) in
+ * time, while the battery is sampled rarely in the normal range. A value of 0
+ * disables the faster sampling.
+ */
+static unsigned int sampler_low_interval_ms = BATTERY_SAMPLER_LOW_INTERVAL_MS;
+module_param(sampler_low_interval_ms, uint, 0644);
+MODULE_PARM_DESC(sampler_low_interval_ms,
+    "Time between two samples while the battery is low in ms (default: 1000)");
+
+/** The capacity in %, at and below which the battery is considered low */
+static unsigned int capacity_low = BATTERY_CAPACITY_LOW;
+module_param(capacity_low, uint, 0644);
+MODULE_PARM_DESC(capacity_low,
+    "Capacity in %, at and below which the battery is low (default: 15)");
+
+/** The capacity in %, at and below which the battery is considered critical */
+static unsigned int capacity_critical = BATTERY_CAPACITY_CRITICAL;
+module_param(capacity_critical, uint, 0644);
+MODULE_PARM_DESC(capacity_critical,
+    "Capacity in %, at and below which the battery is critical (default: 5)");
+
+/**
+ * The window of the averaged (dis-)charging rate in milli seconds.
+ *
+ * The time until the battery is empty or full is estimated with an
+ * exponentially weighted moving average of the rate instead of the
+ * instantaneous rate, so that the estimations do not jump around. Every new
+ * reading of the rate is weighted by the time since the previous one relative
+ * to this window. A value of 0 disables the averaging.
+ */
+static unsigned int estimate_window_ms = BATTERY_ESTIMATE_WINDOW_MS;
+module_param(estimate_window_ms, uint, 0644);
+MODULE_PARM_DESC(estimate_window_ms,
+    "Window of the averaged rate for the time estimations in ms (default: 60000)");
 
-/** Read the current in mA */
-static unsigned int battery_current(void) {
+/**
+ * The state of the averaged (dis-)charging rate.
+ *
+ * Protected by the snapshot lock.
+ */
+struct battery_estimator {
+    bool valid;
+    /** The status of the battery, for which the average was computed */
+    unsigned int status;
+    /** The averaged rate in uW */
     unsigned int rate;
-    rate = read_word_register(BATTERY_REGISTER_RATE);
-    if (rate > 0x7FFF) rate = 0x10000 - rate;
+    /** The time of the last rate reading included in the average in jiffies */
+    unsigned long timestamp;
+};
 
-    return rate;
-}
+/**
+ * The maximum time between two refreshes in milli seconds, over which the
+ * energy is integrated. After a longer gap (e.g. a suspend), the integration is
+ * restarted from the energy register.
+ */
+#define BATTERY_INTEGRATOR_MAX_GAP_MS (5 * 60 * 1000)
 
-/** Read the current (dis-)charging rate in mW */
-static inline unsigned int battery_rate(void) {
-    return battery_current() * battery_voltage();
-}
+/**
+ * The energy integrator ("coulomb counter").
+ *
+ * The power of the battery is integrated over time, so that the energy can be
+ * estimated between two reads of the energy register and the energy throughput
+ * of the battery is known. The integration is re-anchored to the energy
+ * register, whenever it is read, while the throughput keeps being counted.
+ * Energies are kept in uW * ms.
+ *
+ * Protected by the snapshot lock.
+ */
+struct battery_integrator {
+    bool valid;
+    /** The time of the last integration step */
+    ktime_t timestamp;
+    /** The power at the last integration step in uW (negative if discharging) */
+    s64 power;
+    /** The energy of the last read of the energy register in mWh */
+    unsigned int anchor;
+    /** The energy integrated since the anchor */
+    s64 integrated;
+    /** The total energy charged into and discharged from the battery */
+    u64 charged;
+    u64 discharged;
+};
 
-/** Read the current battery status (charging, discharging, full or unknown) */
-static unsigned int battery_status(void) {
-    const u8 status = read_byte_register(BATTERY_REGISTER_STATUS);
+/** The number of uW * ms in one mWh */
+#define UW_MS_PER_MWH (1000LL * 60 * 60 * 1000)
 
-    if (status & 0x01) {
-        return POWER_SUPPLY_STATUS_DISCHARGING;
-    } else if (status & 0x02) {
-        return POWER_SUPPLY_STATUS_CHARGING;
-    } else if ((status & 0x03) == 0x00) {
-        unsigned int energy = battery_energy();
-        /* allow 10% tolerance */
-        if (energy >= 100 * BATTERY_DEFAULT_FULL_ENERGY / 90)
-            battery_last_full_energy = energy;
-        return POWER_SUPPLY_STATUS_FULL;
-    } else {
-        return POWER_SUPPLY_STATUS_UNKNOWN;
-    }
-}
+/** The size of the memory holding the battery history, incl. the header page */
+#define BATTERY_HISTORY_MAPPING_SIZE (PAGE_SIZE + PAGE_ALIGN( \
+    BATTERY_HISTORY_SIZE * sizeof(struct battery_history_sample)))
 
-/** Read the capacity in % (energy compared to energy if full) */
-static unsigned int battery_capacity(void) {
-    unsigned int last_full = battery_energy_full();
-    if (unlikely(!last_full)) {
-        return 0;
-    } else {
-        unsigned int capacity;
-        /* rounded division */
-        capacity = (100 * battery_energy() + last_full / 2) / last_full;
+/**
+ * The history of battery samples.
+ *
+ * It is a ring buffer, which overwrites the oldest samples. The header and the
+ * samples are allocated as one memory area, so that it can be mapped to
+ * userspace as a whole (see `struct battery_history_header`). There is only one
+ * writer, the sampler, but `lock` is taken by the writer and by `read()` to
+ * serve reads without userspace ever seeing a torn sample.
+ */
+struct battery_history {
+    struct battery_history_header *header;
+    struct battery_history_sample *samples;
+    spinlock_t lock;
+};
 
-        return unlikely(capacity > 100) ? 100 : capacity;
-    }
-}
+/**
+ * The capacities in %, which trigger an event, if the capacity crosses them.
+ *
+ * The capacity is only checked, when the battery is refreshed, i.e. when a
+ * property is queried or a sample is taken by the sampler.
+ */
+static unsigned int capacity_thresholds[BATTERY_CAPACITY_THRESHOLDS_MAX] = {
+    5, 15, 80
+};
+static unsigned int capacity_thresholds_count = 3;
+module_param_array(capacity_thresholds, uint, &capacity_thresholds_count, 0644);
+MODULE_PARM_DESC(capacity_thresholds,
+    "Capacities in %, which trigger an event when crossed (default: 5,15,80)");
 
-/** Read the level of capacity. Calculation based on fixed thresholds */
-static unsigned int battery_capaity_level(void) {
-    if (battery_status() == POWER_SUPPLY_STATUS_FULL) {
-        return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-    } else {
-        const unsigned int capacity = battery_capacity();
-        if (capacity >= 99)
-            return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
-        else if (capacity <= 5)
-            return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
-        else if (capacity <= 15)
-            return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
-        else
-            return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+/**
+ * The events of the battery and the AC adapter.
+ *
+ * It is a ring buffer, which overwrites the oldest events. Protected by
+ * `lock`. Readers waiting for new events sleep on `wait`.
+ */
+struct battery_events {
+    struct battery_event events[BATTERY_EVENTS_SIZE];
+    /** The sequence number of the next event */
+    u64 head;
+    spinlock_t lock;
+    wait_queue_head_t wait;
+};
+
+/**
+ * The change of the capacity in %, which triggers a uevent of the battery.
+ *
+ * The battery signals changes to userspace (e.g. upower) only on meaningful
+ * deltas: a status change, a change of the capacity level, a capacity change of
+ * at least this value since the last uevent or a voltage drop below
+ * `uevent_voltage_min_mv`. A value of 0
+ * disables uevents on capacity changes.
+ */
+static unsigned int uevent_capacity_delta = BATTERY_UEVENT_CAPACITY_DELTA;
+module_param(uevent_capacity_delta, uint, 0644);
+MODULE_PARM_DESC(uevent_capacity_delta,
+    "Capacity change in % triggering a battery uevent (default: 5, 0: off)");
+
+/** The voltage in mV, which triggers a uevent of the battery if crossed */
+static unsigned int uevent_voltage_min_mv = BATTERY_UEVENT_VOLTAGE_MIN_MV;
+module_param(uevent_voltage_min_mv, uint, 0644);
+MODULE_PARM_DESC(uevent_voltage_min_mv,
+    "Voltage in mV triggering a battery uevent when crossed (default: 6800)");
+
+/**
+ * The minimum time between two uevents of the battery in milli seconds.
+ *
+ * All changes within this interval are coalesced into a single uevent.
+ */
+static unsigned int uevent_interval_ms = BATTERY_UEVENT_INTERVAL_MS;
+module_param(uevent_interval_ms, uint, 0644);
+MODULE_PARM_DESC(uevent_interval_ms,
+    "Minimum time between two battery uevents in ms (default: 10000)");
+
+/**
+ * The state of the battery uevents.
+ *
+ * Protected by the snapshot lock.
+ */
+struct battery_uevent {
+    /** Whether uevents may be scheduled (i.e. the battery is registered) */
+    bool enabled;
+    /** Whether there was a uevent already */
+    bool notified;
+    /** The time of the last uevent in jiffies */
+    unsigned long timestamp;
+    /** The capacity at the last uevent in % */
+    unsigned int capacity;
+};
+
+/**
+ * The bounds of the time between two samples of the AC adapter state.
+ *
+ * Right after a change of the state, the AC adapter is sampled with the minimum
+ * interval. As long as the state does not change, the interval is doubled with
+ * every sample up to the maximum interval.
+ */
+static unsigned int ac_poll_min_ms = AC_ADAPTER_CHECK_RATE_MIN_MS;
+module_param(ac_poll_min_ms, uint, 0644);
+MODULE_PARM_DESC(ac_poll_min_ms,
+    "Interval of the AC adapter sampling after a change in ms");
+static unsigned int ac_poll_max_ms = AC_ADAPTER_CHECK_RATE_MAX_MS;
+module_param(ac_poll_max_ms, uint, 0644);
+MODULE_PARM_DESC(ac_poll_max_ms,
+    "Maximum interval of the AC adapter sampling while unchanged in ms");
+
+/** The sampling profiles, which set all sampling intervals at once */
+enum battery_profile {
+    BATTERY_PROFILE_PERFORMANCE,
+    BATTERY_PROFILE_BALANCED,
+    BATTERY_PROFILE_POWERSAVE
+};
+
+/** The names of the sampling profiles (see `enum battery_profile`) */
+static const char * const battery_profile_names[] = {
+    [BATTERY_PROFILE_PERFORMANCE] = "performance",
+    [BATTERY_PROFILE_BALANCED] = "balanced",
+    [BATTERY_PROFILE_POWERSAVE] = "powersave"
+};
+
+/** The intervals of a sampling profile in milli seconds */
+struct battery_profile_intervals {
+    unsigned int ac_poll_min_ms;
+    unsigned int ac_poll_max_ms;
+    /** The time to live of all battery registers */
+    unsigned int ttl_ms;
+    unsigned int sampler_interval_ms;
+    unsigned int uevent_interval_ms;
+};
+
+/** The intervals of every sampling profile */
+static const struct battery_profile_intervals battery_profiles[] = {
+    [BATTERY_PROFILE_PERFORMANCE] = {
+        .ac_poll_min_ms = 250,
+        .ac_poll_max_ms = 2000,
+        .ttl_ms = 250,
+        .sampler_interval_ms = 1000,
+        .uevent_interval_ms = 2000
+    },
+    /* the defaults of the individual parameters */
+    [BATTERY_PROFILE_BALANCED] = {
+        .ac_poll_min_ms = AC_ADAPTER_CHECK_RATE_MIN_MS,
+        .ac_poll_max_ms = AC_ADAPTER_CHECK_RATE_MAX_MS,
+        .ttl_ms = BATTERY_REGISTER_TTL_MS,
+        .sampler_interval_ms = BATTERY_SAMPLER_INTERVAL_MS,
+        .uevent_interval_ms = BATTERY_UEVENT_INTERVAL_MS
+    },
+    [BATTERY_PROFILE_POWERSAVE] = {
+        .ac_poll_min_ms = 2000,
+        .ac_poll_max_ms = 30000,
+        .ttl_ms = 5000,
+        .sampler_interval_ms = 60000,
+        .uevent_interval_ms = 60000
     }
+};
+
+/** The last selected sampling profile */
+static enum battery_profile profile = BATTERY_PROFILE_BALANCED;
+
+/**
+ * Select a sampling profile.
+ *
+ * This sets the AC adapter poll intervals, the time to live of all battery
+ * registers, the sampler interval and the uevent interval at once. They can
+ * still be changed individually afterwards. The sampler and the AC adapter
+ * polling are restarted with the new intervals.
+ */
+static int profile_set(const char *value, const struct kernel_param *kp) {
+    const struct battery_profile_intervals *intervals;
+    int selected;
+
+    selected = sysfs_match_string(battery_profile_names, value);
+    if (selected < 0)
+        return selected;
+    intervals = &battery_profiles[selected];
+
+    WRITE_ONCE(ac_poll_min_ms, intervals->ac_poll_min_ms);
+    WRITE_ONCE(ac_poll_max_ms, intervals->ac_poll_max_ms);
+    WRITE_ONCE(ttl_status_ms, intervals->ttl_ms);
+    WRITE_ONCE(ttl_energy_ms, intervals->ttl_ms);
+    WRITE_ONCE(ttl_voltage_ms, intervals->ttl_ms);
+    WRITE_ONCE(ttl_rate_ms, intervals->ttl_ms);
+    WRITE_ONCE(sampler_interval_ms, intervals->sampler_interval_ms);
+    WRITE_ONCE(uevent_interval_ms, intervals->uevent_interval_ms);
+    profile = selected;
+
+    battery_samplers_restart();
+    ac_adapters_restart();
+    return 0;
 }
 
-/** Read the estimated time until the battery is empty */
-static unsigned int battery_time_to_empty(void) {
-    unsigned int rate = battery_rate();
-    if (unlikely(!rate))
-        return 0;
-    return battery_energy() * 60ULL * 60ULL * 1000ULL / rate;
+/** Show the name of the last selected sampling profile */
+static int profile_get(char *buffer, const struct kernel_param *kp) {
+    return sprintf(buffer, "%s\n", battery_profile_names[profile]);
 }
 
-/** Read the state of the AC plug */
-static inline unsigned int ac_adapter_online(void) {
-    u8 data = i2c_smbus_read_byte_data(ac_adapter_device, AC_ADAPTER_REGISTER);
+static const struct kernel_param_ops profile_ops = {
+    .set = profile_set,
+    .get = profile_get
+};
+module_param_cb(profile, &profile_ops, NULL, 0644);
+MODULE_PARM_DESC(profile,
+    "Sampling profile: performance, balanced or powersave (default: balanced)");
 
-    return data & 0x10 ? 1 : 0;
+/**
+ * The GPIOs signalling changes of the AC adapter state, one per instance.
+ *
+ * If a valid GPIO is given, its interrupt triggers an immediate update of the
+ * AC state and the periodical sampling is only kept as a safety net with the
+ * maximum interval. Otherwise the AC adapter state is polled.
+ */
+static int ac_adapter_gpio[BATTERY_INSTANCES_MAX] = {
+    [0 ... BATTERY_INSTANCES_MAX - 1] = -1
+};
+module_param_array(ac_adapter_gpio, int, NULL, 0444);
+MODULE_PARM_DESC(ac_adapter_gpio,
+    "GPIO numbers of the AC adapter change lines per battery (default: -1, "
+    "i.e. polling)");
+
+/**
+ * Whether the register address and the read of the value should be sent as a
+ * single combined transfer (with a repeated start condition) instead of two
+ * separate transfers.
+ */
+static bool combined_transfer = true;
+module_param(combined_transfer, bool, 0644);
+MODULE_PARM_DESC(combined_transfer,
+    "Read registers with a single combined write+read transfer (default: on)");
+
+#ifdef BATTERY_MOCK_EC
+#include "battery-module-mock.h"
+#else
+/*
+ * Without the emulation of the embedded controller, the bus is accessed
+ * directly.
+ */
+#define ec_transfer i2c_transfer
+#define ec_smbus_read_byte_data i2c_smbus_read_byte_data
+#define ec_check_functionality i2c_check_functionality
+
+static inline void mock_ec_debugfs_init(
+    struct dentry *parent,
+    const unsigned int index
+) {}
+#endif
+
+/** Add the time elapsed since `start` to a latency histogram */
+static void latency_histogram_add(
+    struct latency_histogram *histogram,
+    const ktime_t start
+) {
+    const s64 latency_us = ktime_us_delta(ktime_get(), start);
+    unsigned int bucket = 0;
+
+    if (latency_us > 0)
+        bucket = min_t(unsigned int, ilog2(latency_us) + 1, LATENCY_BUCKETS - 1);
+    atomic_long_inc(&histogram->buckets[bucket]);
 }
 
-/** Read the estimated time until the battery is fully charged */
-static unsigned int battery_time_to_full(void) {
-    int energy_missing;
-    unsigned int rate;
-    if (!ac_adapter_online())
-        return 0;
+/**
+ * A read of an AC adapter register, that is waiting for the bus.
+ *
+ * If the read is merged into a battery transfer (see `struct battery_bus`),
+ * that transfer stores the read byte in `value` and sets `done`. The transfer
+ * may belong to another battery on the bus, so the request carries the address
+ * of its AC adapter.
+ */
+struct ac_adapter_request {
+    u16 addr;
+    u8 reg;
+    u8 value;
+    bool done;
+};
 
-    rate = battery_rate();
-    if (unlikely(!rate))
-        return 0;
+/**
+ * The arbitration of the bus accesses of the driver.
+ *
+ * There is one arbiter per I2C bus, which is shared by all batteries on that
+ * bus (see `battery_bus_get()`), so only one transfer of the driver is on the
+ * bus at a time. The reads of the AC
+ * adapter are latency sensitive and go ahead of the battery transfers: while an
+ * AC read is waiting, no battery transfer is started, unless it takes the AC
+ * read with it. In that case the messages of the AC read are appended to the
+ * battery messages and both devices are read with a single combined transfer,
+ * so the AC read does not wait for the battery transfer at all. Such a transfer
+ * changes the target address in between, which not every I2C controller
+ * supports, so merging is only used while the controller does not reject it
+ * (see `battery_bus_mergeable()`).
+ *
+ * This only orders the transfers of this driver, other drivers on the bus are
+ * arbitrated by the I2C core as before.
+ */
+struct battery_bus {
+    /** The number of the bus and the entry in `battery_buses` */
+    int nr;
+    struct list_head list;
+    /** The batteries using the arbiter, protected by `battery_contexts_lock` */
+    struct kref kref;
+    /**
+     * Set, if AC reads may be merged into battery transfers. This requires a
+     * controller without restrictions on the messages of a transfer and is
+     * cleared, if the controller rejects a merged transfer.
+     */
+    bool merge_supported;
+
+    spinlock_t lock;
+    /** Set, while a transfer of the driver is on the bus */
+    bool busy;
+    /** The number of AC reads waiting for the bus */
+    unsigned int urgent;
+    /** An AC read, that can be merged into the next combined transfer */
+    struct ac_adapter_request *merge;
+    /** The transfers waiting for the bus */
+    wait_queue_head_t wait;
+};
 
-    energy_missing = battery_energy_full() - battery_energy();
-    if (unlikely(energy_missing) < 0)
-        energy_missing = 0;
+/**
+ * The state of the AC adapter.
+ *
+ * `connected` is only written by `ac_adapter_updater()` and read without any
+ * lock, the rest is only used by the updater.
+ */
+struct ac_adapter_state {
+    unsigned int connected;
+    /** The state and the poll interval of the last update */
+    unsigned int last_state;
+    unsigned int interval_ms;
+    /** The GPIO signalling changes of the state or a negative value */
+    int gpio;
+    /** The interrupt of the GPIO or a negative value if unused */
+    int irq;
+};
 
-    return energy_missing * 60ULL * 60ULL * 1000ULL / rate;
+/**
+ * The state of a battery and its AC adapter.
+ *
+ * Every battery handled by the driver has its own context, so the instances do
+ * not share any state: each one has its own cache, sampler, history and
+ * devices. Only the arbiter of the I2C bus is shared by the batteries on the
+ * same bus. The context is the client data of the I2C device of the battery.
+ * The module parameters are shared by all instances.
+ *
+ * The context is reference counted: the driver holds one reference while the
+ * battery is bound and every open character device holds another one, so that
+ * the context outlives the removal of the battery while a file is still open.
+ */
+struct battery_context {
+    struct kref kref;
+    /** The number of the instance, used in the names of its devices */
+    unsigned int index;
+    /** The entry in `battery_contexts` */
+    struct list_head list;
+    /**
+     * Set, when the battery is removed. The open files of its character
+     * devices fail from then on. Protected by the lock of the events.
+     */
+    bool removed;
+
+    struct i2c_client *battery_device;
+    struct i2c_client *ac_adapter_device;
+    /** The regmap of the battery registers */
+    struct regmap *regmap;
+    /** The arbiter of the I2C bus, shared with the other batteries on it */
+    struct battery_bus *bus;
+    /**
+     * Set, if the I2C controller supports plain I2C transfers of arbitrary
+     * length. This is required for burst reads, otherwise the byte-wise reads
+     * are used.
+     */
+    bool burst_read_supported;
+    /**
+     * Set, if the I2C controller rejected a combined transfer. In that case the
+     * split transfers are used from then on, regardless of the value of
+     * `combined_transfer`.
+     */
+    bool combined_transfer_rejected;
+
+    char battery_name[8];
+    char ac_adapter_name[8];
+    struct power_supply_desc battery_description;
+    struct power_supply_desc ac_adapter_description;
+    /** The power supplies, that are supplied from the AC plug */
+    char *ac_adapter_to[1];
+    struct power_supply *battery;
+    struct power_supply *ac_adapter;
+
+    /**
+     * The cached battery snapshot.
+     *
+     * There is only one writer at a time, the holder of `snapshot_lock`, which
+     * serializes all refreshes (and therefore the bus accesses of the battery).
+     * Every change of the snapshot is published via `snapshot_seqlock`, so that
+     * readers can take a consistent copy without any lock (see
+     * `battery_snapshot_read()`).
+     */
+    struct battery_snapshot cache;
+    struct mutex snapshot_lock;
+    seqlock_t snapshot_seqlock;
+    struct battery_refresh refresh;
+    struct battery_breaker breaker;
+    /** The work that probes the battery while the circuit breaker is open */
+    struct delayed_work breaker_work;
+    /**
+     * The energy stored in the battery the last time it was full.
+     *
+     * It is only accessed while evaluating a snapshot, i.e. by the holder of
+     * `snapshot_lock`. Everybody else uses the value of the snapshot.
+     */
+    unsigned int last_full_energy;
+    struct battery_estimator estimator;
+    struct battery_integrator integrator;
+
+    struct battery_uevent uevent;
+    /** The work signalling a change of the battery to userspace */
+    struct delayed_work uevent_work;
+    struct battery_events events;
+    struct battery_history history;
+    /** The work that periodically records samples in the battery history */
+    struct delayed_work sampler_work;
+    /**
+     * Whether the sampler and the AC adapter work may be scheduled (i.e. the
+     * battery is bound and not suspended)
+     */
+    bool sampler_enabled;
+
+    struct ac_adapter_state ac_adapter_state;
+    /** The work that periodically checks the AC adapter connection status */
+    struct delayed_work ac_adapter_work;
+
+    struct battery_stats stats;
+    char history_name[32];
+    char events_name[32];
+    struct miscdevice history_device;
+    struct miscdevice events_device;
+    /** The snapshot attribute and the attribute groups of the battery */
+    struct bin_attribute snapshot_attr;
+    struct bin_attribute *battery_bin_attrs[2];
+    struct attribute_group battery_group;
+    const struct attribute_group *battery_groups[2];
+};
+
+/** The contexts of all bound batteries, protected by `battery_contexts_lock` */
+static LIST_HEAD(battery_contexts);
+static DEFINE_MUTEX(battery_contexts_lock);
+
+/** Free a battery context, once its last reference is dropped */
+static void battery_context_free(struct kref *kref) {
+    struct battery_context *ctx =
+        container_of(kref, struct battery_context, kref);
+
+    vfree(ctx->history.header);
+    kfree(ctx);
 }
 
+/** Drop a reference of a battery context */
+static inline void battery_context_put(struct battery_context *ctx) {
+    kref_put(&ctx->kref, battery_context_free);
+}
+
+/** Check, if the battery of a context was removed */
+static bool battery_context_removed(struct battery_context *ctx) {
+    bool removed;
+
+    spin_lock(&ctx->events.lock);
+    removed = ctx->removed;
+    spin_unlock(&ctx->events.lock);
+    return removed;
+}
 
 /**
- * Query a property from the battery.
- *
- * The function is called by the kernel, if any information from the driver is
- * required.
+ * Whether an AC read can be merged into a battery transfer.
  *
- * The function is currently designed in a way, that the "battery information"
- * (see ACPI documentation) is read at every call to this function. The relevant
- * data is the used inside the function.
+ * Only combined battery transfers take an AC read with them, and only if the
+ * controller supports a change of the target address within a transfer.
+ */
+static inline bool battery_bus_mergeable(const struct battery_context *ctx) {
+    return READ_ONCE(combined_transfer) &&
+        !READ_ONCE(ctx->combined_transfer_rejected) &&
+        READ_ONCE(ctx->bus->merge_supported);
+}
+
+/**
+ * Check, whether the I2C controller can do merged transfers.
  *
- * The function returns 0 (success) on every known property, otherwise the
- * negative value of the "invalid value" error is returned (negative, since the
- * function is a callback, that should return a negative number on failure).
+ * A merged transfer consists of four messages to two addresses. Controllers
+ * with any restriction on the messages of a transfer (e.g. only a write
+ * followed by a read to the same address) cannot do that.
  */
-static int battery_get_property(
-    struct power_supply *supply,
+static bool battery_bus_merge_supported(struct i2c_adapter *adapter) {
+    return ec_check_functionality(adapter, I2C_FUNC_I2C) && !adapter->quirks;
+}
+
+/** The arbiters of the I2C buses, protected by `battery_contexts_lock` */
+static LIST_HEAD(battery_buses);
+
+/**
+ * Get the arbiter of an I2C bus.
+ *
+ * The batteries on the same bus share the arbiter, it is allocated for the
+ * first one. The caller has to hold `battery_contexts_lock`. The function
+ * returns NULL, if the arbiter could not be allocated.
+ */
+static struct battery_bus *battery_bus_get(struct i2c_adapter *adapter) {
+    struct battery_bus *bus;
+
+    list_for_each_entry(bus, &battery_buses, list) {
+        if (bus->nr == adapter->nr) {
+            kref_get(&bus->kref);
+            return bus;
+        }
+    }
+
+    bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (!bus)
+        return NULL;
+    bus->nr = adapter->nr;
+    kref_init(&bus->kref);
+    bus->merge_supported = battery_bus_merge_supported(adapter);
+    spin_lock_init(&bus->lock);
+    init_waitqueue_head(&bus->wait);
+    list_add_tail(&bus->list, &battery_buses);
+    return bus;
+}
+
+/** Free an arbiter, once the last battery on its bus is gone */
+static void battery_bus_free(struct kref *kref) {
+    struct battery_bus *bus = container_of(kref, struct battery_bus, kref);
+
+    list_del(&bus->list);
+    kfree(bus);
+}
+
+/**
+ * Drop a reference of an arbiter. The caller has to hold
+ * `battery_contexts_lock`.
+ */
+static void battery_bus_put(struct battery_bus *bus) {
+    kref_put(&bus->kref, battery_bus_free);
+}
+
+/**
+ * Try to claim the bus for a battery transfer.
+ *
+ * The bus is claimed, if it is idle and no AC read is waiting, or the waiting
+ * AC read can be merged into the transfer (`mergeable`). In the latter case the
+ * AC read is stored in `merged`.
+ */
+static bool battery_bus_try_claim(
+    struct battery_bus *bus,
+    const bool mergeable,
+    struct ac_adapter_request **merged
+) {
+    bool claimed = false;
+
+    spin_lock(&bus->lock);
+    if (!bus->busy && (!bus->urgent || (mergeable && bus->merge))) {
+        bus->busy = true;
+        *merged = mergeable ? bus->merge : NULL;
+        if (mergeable)
+            bus->merge = NULL;
+        claimed = true;
+    }
+    spin_unlock(&bus->lock);
+    return claimed;
+}
+
+/**
+ * Try to claim the bus for an AC read.
+ *
+ * This succeeds as well, if the read was already done by a battery transfer.
+ */
+static bool battery_bus_try_claim_urgent(
+    struct battery_bus *bus,
+    struct ac_adapter_request *request
+) {
+    bool claimed = false;
+
+    spin_lock(&bus->lock);
+    if (request->done || !bus->busy) {
+        if (!request->done)
+            bus->busy = true;
+        if (bus->merge == request)
+            bus->merge = NULL;
+        bus->urgent--;
+        claimed = true;
+    }
+    spin_unlock(&bus->lock);
+    return claimed;
+}
+
+/**
+ * Wait for the bus for a battery transfer.
+ *
+ * If the transfer can take an AC read with it (`mergeable`), the function
+ * returns a waiting AC read, that has to be merged into the transfer.
+ * Otherwise it returns NULL.
+ */
+static struct ac_adapter_request *battery_bus_acquire(
+    struct battery_bus *bus,
+    const bool mergeable
+) {
+    struct ac_adapter_request *merged;
+
+    wait_event(bus->wait, battery_bus_try_claim(bus, mergeable, &merged));
+    return merged;
+}
+
+/**
+ * Wait for the bus for an AC read.
+ *
+ * The AC read is offered for merging into a battery transfer while waiting. The
+ * function returns true, if that happened and the read is already done. The bus
+ * is not claimed in that case.
+ */
+static bool battery_bus_acquire_urgent(
+    struct battery_context *ctx,
+    struct ac_adapter_request *request
+) {
+    struct battery_bus *bus = ctx->bus;
+
+    spin_lock(&bus->lock);
+    bus->urgent++;
+    if (!bus->merge && battery_bus_mergeable(ctx))
+        bus->merge = request;
+    spin_unlock(&bus->lock);
+
+    wait_event(bus->wait, battery_bus_try_claim_urgent(bus, request));
+    if (request->done)
+        /* the battery transfers were held back by this read */
+        wake_up_all(&bus->wait);
+    return request->done;
+}
+
+/**
+ * Release the bus after a transfer.
+ *
+ * If an AC read was merged into the transfer, `done` tells whether it
+ * succeeded. Otherwise the AC read does its own transfer afterwards.
+ */
+static void battery_bus_release(
+    struct battery_bus *bus,
+    struct ac_adapter_request *merged,
+    bool done
+) {
+    spin_lock(&bus->lock);
+    if (merged)
+        merged->done = done;
+    bus->busy = false;
+    spin_unlock(&bus->lock);
+    wake_up_all(&bus->wait);
+}
+
+/**
+ * Transfer I2C messages to the battery and the merged AC read, if any.
+ *
+ * Only a combined battery transfer (the write of the register address and the
+ * read of the registers) is merged with a waiting AC read. If the merged
+ * transfer fails, the battery messages are transferred again on their own, so
+ * that a controller not supporting merged transfers does not fail the battery
+ * transfer nor disable the combined transfers. Merging is disabled, if the
+ * controller rejects it. The AC read does its own transfer in that case.
+ *
+ * The function returns `num` if all battery messages were transferred, a
+ * negative error code otherwise.
+ */
+static int battery_bus_transfer(
+    struct battery_context *ctx,
+    struct i2c_msg *msgs,
+    const int num
+) {
+    struct ac_adapter_request *merged =
+        battery_bus_acquire(ctx->bus, num == 2 && battery_bus_mergeable(ctx));
+    struct i2c_msg all[4];
+    int ret;
+
+    if (merged) {
+        memcpy(all, msgs, 2 * sizeof(*msgs));
+        all[2].addr = merged->addr;
+        all[2].flags = 0;
+        all[2].len = 1;
+        all[2].buf = &merged->reg;
+        all[3].addr = merged->addr;
+        all[3].flags = I2C_M_RD;
+        all[3].len = 1;
+        all[3].buf = &merged->value;
+
+        ret = ec_transfer(ctx->battery_device->adapter, all, ARRAY_SIZE(all));
+        if (ret == ARRAY_SIZE(all)) {
+            battery_bus_release(ctx->bus, merged, true);
+            return num;
+        }
+        if (ret == -EOPNOTSUPP || ret == -EINVAL) {
+            printk(KERN_INFO "Battery module: Merged transfers are not "
+                    "supported by the I2C controller of %s\n",
+                    ctx->battery_name
+            );
+            WRITE_ONCE(ctx->bus->merge_supported, false);
+        }
+    }
+
+    ret = ec_transfer(ctx->battery_device->adapter, msgs, num);
+    battery_bus_release(ctx->bus, merged, false);
+    return ret;
+}
+
+/**
+ * Whether contiguous battery registers should be read with a single burst
+ * transfer instead of one transfer per register.
+ */
+static bool burst_read = true;
+module_param(burst_read, bool, 0644);
+MODULE_PARM_DESC(burst_read,
+    "Read contiguous registers with a single burst transfer (default: on)");
+
+/** The maximum number of tries of a single I2C transfer */
+static unsigned int i2c_max_tries = I2C_MAX_TRIES;
+module_param(i2c_max_tries, uint, 0644);
+MODULE_PARM_DESC(i2c_max_tries, "Maximum number of tries of an I2C transfer");
+
+/**
+ * The back-off delay before the first retry of a failed I2C transfer.
+ *
+ * The delay is doubled with every further retry, up to the maximum delay.
+ */
+static unsigned int i2c_retry_delay_us = I2C_RETRY_DELAY_US;
+module_param(i2c_retry_delay_us, uint, 0644);
+MODULE_PARM_DESC(i2c_retry_delay_us,
+    "Back-off delay before the first retry of an I2C transfer in us");
+static unsigned int i2c_retry_delay_max_us = I2C_RETRY_DELAY_MAX_US;
+module_param(i2c_retry_delay_max_us, uint, 0644);
+MODULE_PARM_DESC(i2c_retry_delay_max_us,
+    "Maximum back-off delay between two tries of an I2C transfer in us");
+
+/** The ways a failed I2C transfer is handled, depending on the error */
+enum i2c_retry_action {
+    /** Give up immediately, since a retry would fail the same way */
+    I2C_RETRY_NEVER,
+    /** Retry immediately, since the bus is free again (lost arbitration) */
+    I2C_RETRY_IMMEDIATELY,
+    /** Retry after the back-off delay, since the battery is busy (NACK) */
+    I2C_RETRY_BACKOFF
+};
+
+/** Decide, how a failed I2C transfer is handled */
+static enum i2c_retry_action i2c_retry_action(const int error) {
+    switch (error) {
+    case -EAGAIN:
+        /* arbitration lost */
+        return I2C_RETRY_IMMEDIATELY;
+    case -ENXIO:
+    case -EREMOTEIO:
+        /* no acknowledge */
+    case -ETIMEDOUT:
+    case -EIO:
+        return I2C_RETRY_BACKOFF;
+    default:
+        return I2C_RETRY_NEVER;
+    }
+}
+
+/**
+ * Transfer I2C messages to the battery, retrying it on failures.
+ *
+ * Whether and when a failed transfer is retried depends on the error (see
+ * `i2c_retry_action()`), but it is tried at most `i2c_max_tries` times. Only the
+ * final failure is logged and this is rate limited, so that an unresponsive
+ * battery does not flood the kernel log. The number of tries is added to
+ * `total_tries`.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int battery_i2c_transfer(
+    struct battery_context *ctx,
+    struct i2c_msg *msgs,
+    const int num,
+    const u8 reg,
+    unsigned int *total_tries
+) {
+    unsigned int delay_us = i2c_retry_delay_us;
+    enum i2c_retry_action action;
+    unsigned int tries;
+    int ret;
+
+    for (tries = 1; ; tries++) {
+        atomic_long_inc(&ctx->stats.registers[reg].transfers);
+        if (tries > 1)
+            atomic_long_inc(&ctx->stats.registers[reg].retries);
+
+        ret = battery_bus_transfer(ctx, msgs, num);
+        if (ret == num) {
+            *total_tries += tries;
+            return 0;
+        }
+        if (ret >= 0)
+            ret = -EIO;
+
+        action = i2c_retry_action(ret);
+        if (action == I2C_RETRY_NEVER || tries >= i2c_max_tries)
+            break;
+        if (action == I2C_RETRY_BACKOFF && delay_us) {
+            usleep_range(delay_us, delay_us + delay_us / 2);
+            delay_us = min(2 * delay_us, i2c_retry_delay_max_us);
+        }
+    }
+
+    *total_tries += tries;
+    atomic_long_inc(&ctx->stats.registers[reg].failures);
+    if (ret != -EOPNOTSUPP)
+        printk_ratelimited(KERN_ERR "Battery module: Transfer of register "
+                "0x%02X of %s failed (Result: %d, %u tries)\n", reg,
+                ctx->battery_name, ret, tries
+        );
+    return ret;
+}
+
+/**
+ * Read `len` contiguous battery registers starting at `reg` into `buf`.
+ *
+ * The "special" register access operation is used, i.e. 0x80 is written to the
+ * slave first, then the required sub-register and the the read of the bytes.
+ * The battery increments the register address after each byte read.
+ *
+ * Both steps are sent as one combined transfer, if enabled and supported by the
+ * controller. Otherwise they are sent as two separate transfers.
+ *
+ * The function returns 0 on success and a negative error code otherwise. The
+ * number of I2C tries is added to `tries`.
+ */
+static int __read_block_register(
+    struct battery_context *ctx,
+    const u8 reg,
+    u8 *buf,
+    const u16 len,
+    unsigned int *tries
+) {
+    struct i2c_msg msgs[2];
+    u8 bufo[8] = {0};
+    int ret;
+
+    bufo[0] = 0x02;
+    bufo[1] = 0x80;
+    bufo[2] = reg;
+    msgs[0].addr = ctx->battery_device->addr;
+    msgs[0].len = 5;
+    msgs[0].flags = 0;
+    msgs[0].buf = bufo;
+    msgs[1].addr = ctx->battery_device->addr;
+    msgs[1].len = len;
+    msgs[1].flags = I2C_M_RD;
+    msgs[1].buf = buf;
+
+    if (combined_transfer && !ctx->combined_transfer_rejected) {
+        ret = battery_i2c_transfer(ctx, msgs, 2, reg, tries);
+        if (ret != -EOPNOTSUPP && ret != -EINVAL)
+            return ret;
+
+        printk(KERN_INFO "Battery module: Combined transfers are not "
+                "supported by the I2C controller, using split transfers\n"
+        );
+        WRITE_ONCE(ctx->combined_transfer_rejected, true);
+    }
+
+    ret = battery_i2c_transfer(ctx, &msgs[0], 1, reg, tries);
+    if (ret) return ret;
+    return battery_i2c_transfer(ctx, &msgs[1], 1, reg, tries);
+}
+
+/**
+ * Read `len` contiguous battery registers and record the latency of the read.
+ *
+ * The read is recorded in the debugfs statistics and traced.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int read_block_register(
+    struct battery_context *ctx,
+    const u8 reg,
+    u8 *buf,
+    const u16 len
+) {
+    const ktime_t start = ktime_get();
+    unsigned int tries = 0;
+    int ret;
+
+    ret = __read_block_register(ctx, reg, buf, len, &tries);
+    latency_histogram_add(&ctx->stats.register_latency, start);
+    trace_battery_register_read(reg, len, ret, tries,
+            ktime_to_ns(ktime_sub(ktime_get(), start)));
+    return ret;
+}
+
+/**
+ * Read contiguous battery registers for the regmap of the battery.
+ *
+ * This implements the custom access protocol of the battery as a regmap bus
+ * (see `read_block_register()`). The context of the regmap is the context of
+ * the battery.
+ */
+static int battery_regmap_read(
+    void *context,
+    const void *reg_buf,
+    size_t reg_size,
+    void *val_buf,
+    size_t val_size
+) {
+    return read_block_register(context, *(const u8 *)reg_buf, val_buf,
+            val_size);
+}
+
+/** Write battery registers for the regmap: the battery is read-only */
+static int battery_regmap_write(void *context, const void *data, size_t count) {
+    return -EOPNOTSUPP;
+}
+
+/** The regmap bus implementing the access protocol of the battery */
+static const struct regmap_bus battery_regmap_bus = {
+    .read = battery_regmap_read,
+    .write = battery_regmap_write
+};
+
+/** The readable registers of the battery: the ones of the read plan */
+static const struct regmap_access_table battery_regmap_readable = {
+    .yes_ranges = battery_read_plan,
+    .n_yes_ranges = ARRAY_SIZE(battery_read_plan)
+};
+
+/**
+ * The volatile registers of the battery.
+ *
+ * All registers are measurements, that change at any time, so they are never
+ * served from the regcache. They are cached by the battery snapshot instead,
+ * which knows about the time to live of every register.
+ */
+static const struct regmap_access_table battery_regmap_volatile = {
+    .yes_ranges = battery_read_plan,
+    .n_yes_ranges = ARRAY_SIZE(battery_read_plan)
+};
+
+/** There are no writeable registers */
+static const struct regmap_access_table battery_regmap_writeable = {};
+
+/** The configuration of the regmap of the battery */
+static const struct regmap_config battery_regmap_config = {
+    .name = "battery",
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = 0xFF,
+    .rd_table = &battery_regmap_readable,
+    .wr_table = &battery_regmap_writeable,
+    .volatile_table = &battery_regmap_volatile,
+    .cache_type = REGCACHE_RBTREE
+};
+
+/**
+ * Read a single byte from a battery register.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int read_byte_register(
+    struct battery_context *ctx,
+    const u8 reg,
+    u8 *value
+) {
+    unsigned int val;
+    int ret;
+
+    ret = regmap_read(ctx->regmap, reg, &val);
+    if (ret) return ret;
+
+    *value = val;
+    return 0;
+}
+
+/**
+ * Read a single word from a battery register.
+ *
+ * The LSB is the register address, the MSB is register address + 1.
+ *
+ * Both bytes are read by separate transfers, so the value may change between
+ * them (e.g. the LSB rolls over), which would result in a value off by 256.
+ * Therefore the MSB is read again after the LSB: if it did not change, both
+ * bytes belong to the same value. Otherwise the LSB is read again, at most
+ * `WORD_READ_MAX_TRIES` times.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int read_word_register(
+    struct battery_context *ctx,
+    const u8 reg,
+    u16 *value
+) {
+    unsigned int tries;
+    u8 lsb, msb, check;
+    int ret;
+
+    ret = read_byte_register(ctx, reg + 1, &msb);
+    if (ret) return ret;
+
+    for (tries = 0; tries < WORD_READ_MAX_TRIES; tries++) {
+        ret = read_byte_register(ctx, reg, &lsb);
+        if (ret) return ret;
+        ret = read_byte_register(ctx, reg + 1, &check);
+        if (ret) return ret;
+
+        if (check == msb) {
+            *value = (msb << 8) | lsb;
+            return 0;
+        }
+        msb = check;
+    }
+    return -EAGAIN;
+}
+
+
+/** Decode a little endian word from a buffer of raw register contents */
+static inline u16 decode_word(const u8 *buf) {
+    return (buf[1] << 8) | buf[0];
+}
+
+/** Get the raw contents of a register of a snapshot */
+static inline u8 *battery_register_raw(
+    struct battery_snapshot *snapshot,
+    const enum battery_field field
+) {
+    return &snapshot->raw[battery_registers[field].address -
+        BATTERY_REGISTERS_FIRST];
+}
+
+/**
+ * Decode the value of a register of a snapshot.
+ *
+ * The raw contents are interpreted according to `battery_registers`: as little
+ * endian, optionally signed value, which is multiplied by the scale of the
+ * register.
+ */
+static int battery_register_value(
+    const struct battery_snapshot *snapshot,
+    const enum battery_field field
+) {
+    const struct battery_register *reg = &battery_registers[field];
+    const u8 *raw = &snapshot->raw[reg->address - BATTERY_REGISTERS_FIRST];
+    int value;
+
+    if (reg->width == 2)
+        value = reg->is_signed ? (s16)decode_word(raw) : decode_word(raw);
+    else
+        value = reg->is_signed ? (s8)raw[0] : raw[0];
+    return value * (int)reg->scale;
+}
+
+/**
+ * Check, which registers of a snapshot are outdated.
+ *
+ * All registers are outdated, if the snapshot is not valid or marked as stale.
+ * Otherwise a register is outdated, if it was read longer than its time to
+ * live ago.
+ *
+ * The function returns a bit mask of the outdated registers (see
+ * `enum battery_field`).
+ */
+static unsigned int battery_snapshot_expired(
+    const struct battery_snapshot *snapshot
+) {
+    unsigned int expired = 0;
+    unsigned int field;
+
+    if (!snapshot->valid || snapshot->stale)
+        return BATTERY_FIELDS_ALL;
+
+    for (field = 0; field < BATTERY_FIELDS; field++) {
+        const unsigned long ttl =
+            msecs_to_jiffies(READ_ONCE(*battery_registers[field].ttl_ms));
+        if (!ttl || time_after(jiffies, snapshot->timestamps[field] + ttl))
+            expired |= BIT(field);
+    }
+    return expired;
+}
+
+/**
+ * Read the outdated registers in a range of the read plan using a single burst
+ * read.
+ *
+ * Only the smallest span of registers covering all outdated registers in the
+ * range is read. It is read directly into the raw buffer of the snapshot.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int battery_snapshot_burst_range(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot,
+    const unsigned int expired,
+    const struct regmap_range *range
+) {
+    unsigned int start = range->range_max + 1;
+    unsigned int end = range->range_min;
+    unsigned int field;
+
+    for (field = 0; field < BATTERY_FIELDS; field++) {
+        const struct battery_register *reg = &battery_registers[field];
+        if (!(expired & BIT(field)) || reg->address < range->range_min ||
+                reg->address + reg->width - 1 > range->range_max)
+            continue;
+        start = min_t(unsigned int, start, reg->address);
+        end = max_t(unsigned int, end, reg->address + reg->width);
+    }
+    if (start >= end)
+        return 0;
+
+    return regmap_bulk_read(ctx->regmap, start,
+            &snapshot->raw[start - BATTERY_REGISTERS_FIRST], end - start);
+}
+
+/**
+ * Read the outdated battery registers into a snapshot using burst reads.
+ *
+ * Every range of the read plan (`battery_read_plan`) containing outdated
+ * registers is read with one burst read.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int battery_snapshot_burst(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot,
+    const unsigned int expired
+) {
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < ARRAY_SIZE(battery_read_plan); i++) {
+        ret = battery_snapshot_burst_range(ctx, snapshot, expired,
+                &battery_read_plan[i]);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/**
+ * Read the outdated battery registers into a snapshot one by one.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static int battery_snapshot_bytewise(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot,
+    const unsigned int expired
+) {
+    unsigned int field;
+    int ret;
+
+    for (field = 0; field < BATTERY_FIELDS; field++) {
+        const struct battery_register *reg = &battery_registers[field];
+        u8 *raw = battery_register_raw(snapshot, field);
+        u16 value;
+
+        if (!(expired & BIT(field)))
+            continue;
+
+        if (reg->width == 2) {
+            ret = read_word_register(ctx, reg->address, &value);
+            if (ret) return ret;
+            raw[0] = value & 0xFF;
+            raw[1] = value >> 8;
+        } else {
+            ret = read_byte_register(ctx, reg->address, raw);
+            if (ret) return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the outdated battery registers into a snapshot.
+ *
+ * This is the only place, where the battery registers are accessed. Burst
+ * reads are used if possible, otherwise every register is read on its own.
+ * Registers, that are not outdated yet, are not read again.
+ *
+ * The function returns 0 on success and a negative error code otherwise. The
+ * snapshot is only marked as up-to-date on success.
+ */
+static int battery_snapshot_refresh(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot
+) {
+    const unsigned int expired = battery_snapshot_expired(snapshot);
+    const unsigned long now = jiffies;
+    unsigned int field;
+    int ret = -EOPNOTSUPP;
+
+    if (burst_read && ctx->burst_read_supported)
+        ret = battery_snapshot_burst(ctx, snapshot, expired);
+    if (ret)
+        ret = battery_snapshot_bytewise(ctx, snapshot, expired);
+    if (ret)
+        return ret;
+
+    for (field = 0; field < BATTERY_FIELDS; field++)
+        if (expired & BIT(field))
+            snapshot->timestamps[field] = now;
+    snapshot->timestamp = now;
+    snapshot->valid = true;
+    snapshot->stale = false;
+    return 0;
+}
+
+/** Read the current energy in mWh */
+static inline unsigned int battery_energy(
+    const struct battery_snapshot *snapshot
+) {
+    return battery_register_value(snapshot, BATTERY_FIELD_ENERGY);
+}
+
+/** Read the last full energy in mWh */
+static inline unsigned int battery_energy_full(
+    const struct battery_context *ctx
+) {
+    return ctx->last_full_energy;
+}
+
+/** Read the current voltage in mV */
+static inline unsigned int battery_voltage(
+    const struct battery_snapshot *snapshot
+) {
+    return battery_register_value(snapshot, BATTERY_FIELD_VOLTAGE);
+}
+
+/** Read the current in mA (regardless of charging or discharging) */
+static unsigned int battery_current(const struct battery_snapshot *snapshot) {
+    return abs(battery_register_value(snapshot, BATTERY_FIELD_RATE));
+}
+
+/**
+ * Read the current battery status (charging, discharging, full or unknown).
+ *
+ * The full energy is learned, if the battery is full. The caller has to hold
+ * the snapshot lock.
+ */
+static unsigned int battery_status(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    const u8 status = battery_register_value(snapshot, BATTERY_FIELD_STATUS);
+
+    if (status & 0x01) {
+        return POWER_SUPPLY_STATUS_DISCHARGING;
+    } else if (status & 0x02) {
+        return POWER_SUPPLY_STATUS_CHARGING;
+    } else if ((status & 0x03) == 0x00) {
+        unsigned int energy = battery_energy(snapshot);
+        /* allow 10% tolerance below the design energy */
+        if (energy >= 90 * BATTERY_DEFAULT_FULL_ENERGY / 100)
+            ctx->last_full_energy = energy;
+        return POWER_SUPPLY_STATUS_FULL;
+    } else {
+        return POWER_SUPPLY_STATUS_UNKNOWN;
+    }
+}
+
+/** Calculate the current (dis-)charging rate in uW */
+static inline unsigned int battery_rate(const struct battery_values *values) {
+    return values->current_now * values->voltage;
+}
+
+/** Calculate the capacity in % (energy compared to energy if full) */
+static unsigned int battery_capacity(const struct battery_values *values) {
+    unsigned int last_full = values->energy_full;
+    if (unlikely(!last_full)) {
+        return 0;
+    } else {
+        unsigned int capacity;
+        /* rounded division */
+        capacity = (100 * values->energy + last_full / 2) / last_full;
+
+        return unlikely(capacity > 100) ? 100 : capacity;
+    }
+}
+
+/**
+ * Calculate the level of capacity. Calculation based on the thresholds
+ * `capacity_low` and `capacity_critical`.
+ */
+static unsigned int battery_capaity_level(const struct battery_values *values) {
+    if (values->status == POWER_SUPPLY_STATUS_FULL) {
+        return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+    } else {
+        const unsigned int capacity = values->capacity;
+        if (capacity >= 99)
+            return POWER_SUPPLY_CAPACITY_LEVEL_FULL;
+        else if (capacity <= READ_ONCE(capacity_critical))
+            return POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+        else if (capacity <= READ_ONCE(capacity_low))
+            return POWER_SUPPLY_CAPACITY_LEVEL_LOW;
+        else
+            return POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+    }
+}
+
+/**
+ * Update the averaged (dis-)charging rate with the rate of a snapshot.
+ *
+ * The rate is only added once per reading of the rate register, no matter how
+ * often the snapshot is evaluated. The average is restarted, if the status of
+ * the battery changed, since the rate of charging and of discharging are not
+ * comparable. This is done once per refresh, so that a property query is just
+ * a lookup of the result.
+ *
+ * The caller has to hold the snapshot lock.
+ */
+static unsigned int battery_rate_average(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot,
+    const struct battery_values *values
+) {
+    const unsigned long timestamp = snapshot->timestamps[BATTERY_FIELD_RATE];
+    const unsigned long window = msecs_to_jiffies(READ_ONCE(estimate_window_ms));
+    struct battery_estimator *estimator = &ctx->estimator;
+
+    if (!window || !estimator->valid ||
+            estimator->status != values->status) {
+        estimator->valid = true;
+        estimator->status = values->status;
+        estimator->rate = values->rate;
+    } else if (timestamp != estimator->timestamp) {
+        const unsigned long elapsed =
+            min(timestamp - estimator->timestamp, window);
+        const s64 delta = (s64)values->rate - estimator->rate;
+
+        estimator->rate += div_s64(delta * (s64)elapsed, window);
+    }
+    estimator->timestamp = timestamp;
+
+    return estimator->rate;
+}
+
+/** Calculate the estimated time until the battery is empty */
+static unsigned int battery_time_to_empty(const struct battery_values *values) {
+    unsigned int rate = values->rate_average;
+    if (unlikely(!rate))
+        return 0;
+    return values->energy * 60ULL * 60ULL * 1000ULL / rate;
+}
+
+/** Calculate the estimated time until the battery is fully charged */
+static unsigned int battery_time_to_full(const struct battery_values *values) {
+    int energy_missing;
+    unsigned int rate;
+    if (!values->ac_online)
+        return 0;
+
+    rate = values->rate_average;
+    if (unlikely(!rate))
+        return 0;
+
+    energy_missing = values->energy_full - values->energy;
+    if (unlikely(energy_missing) < 0)
+        energy_missing = 0;
+
+    return energy_missing * 60ULL * 60ULL * 1000ULL / rate;
+}
+
+/**
+ * Integrate the power of the battery up to the refresh of a snapshot.
+ *
+ * The power since the last refresh is integrated and added to the energy of
+ * the last read of the energy register. If the energy register was read by this
+ * refresh, it is used directly and becomes the new anchor of the integration.
+ * This allows a longer time to live of the energy register, without the energy
+ * (and the values derived from it) getting outdated.
+ *
+ * The function returns the (estimated) energy in mWh. The caller has to hold
+ * the snapshot lock.
+ */
+static unsigned int battery_energy_integrated(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    struct battery_integrator *integrator = &ctx->integrator;
+    const bool anchored = !integrator->valid ||
+        snapshot->timestamps[BATTERY_FIELD_ENERGY] == snapshot->timestamp;
+    const ktime_t now = ktime_get();
+    const s64 elapsed_ms = ktime_ms_delta(now, integrator->timestamp);
+    s64 energy;
+
+    /* the throughput is counted on every step, also when re-anchoring */
+    if (integrator->valid && elapsed_ms <= BATTERY_INTEGRATOR_MAX_GAP_MS) {
+        const s64 delta = integrator->power * elapsed_ms;
+
+        integrator->integrated += delta;
+        if (delta >= 0)
+            integrator->charged += delta;
+        else
+            integrator->discharged += -delta;
+    }
+    if (anchored || elapsed_ms > BATTERY_INTEGRATOR_MAX_GAP_MS) {
+        integrator->anchor = battery_energy(snapshot);
+        integrator->integrated = 0;
+    }
+    integrator->valid = true;
+    integrator->timestamp = now;
+    integrator->power =
+        (s64)battery_register_value(snapshot, BATTERY_FIELD_RATE) *
+        battery_voltage(snapshot);
+
+    energy = integrator->anchor +
+        div64_s64(integrator->integrated, UW_MS_PER_MWH);
+    return clamp_t(s64, energy, 0, UINT_MAX);
+}
+
+/**
+ * Compute all values derived from the raw registers of a snapshot.
+ *
+ * This is done once per refresh, so that every property query is just a lookup
+ * and no value has to be computed (or even read) twice. The caller has to hold
+ * the snapshot lock.
+ */
+static void battery_snapshot_evaluate(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot
+) {
+    struct battery_values *values = &snapshot->values;
+
+    values->energy = battery_energy_integrated(ctx, snapshot);
+    values->voltage = battery_voltage(snapshot);
+    values->current_now = battery_current(snapshot);
+    /* must be evaluated before the full energy, since it may update it */
+    values->status = battery_status(ctx, snapshot);
+    values->energy_full = battery_energy_full(ctx);
+    values->ac_online = READ_ONCE(ctx->ac_adapter_state.connected);
+
+    values->rate = battery_rate(values);
+    values->rate_average = battery_rate_average(ctx, snapshot, values);
+    values->capacity = battery_capacity(values);
+    values->capacity_level = battery_capaity_level(values);
+    values->time_to_empty = battery_time_to_empty(values);
+    values->time_to_full = battery_time_to_full(values);
+}
+
+/**
+ * Check, whether a snapshot may be used without reading the registers again.
+ *
+ * This is the case, if none of its registers is outdated.
+ */
+static inline bool battery_snapshot_fresh(
+    const struct battery_snapshot *snapshot
+) {
+    return !battery_snapshot_expired(snapshot);
+}
+
+/**
+ * Record a failed refresh of the snapshot in the circuit breaker.
+ *
+ * After `breaker_threshold` consecutive failures, the breaker is opened: the
+ * bus is not accessed by property queries anymore and the last good snapshot
+ * is served instead. The battery is probed again in the background after the
+ * cooldown period.
+ */
+static void battery_breaker_failure(struct battery_context *ctx) {
+    struct battery_breaker *breaker = &ctx->breaker;
+
+    if (!breaker_threshold || ++breaker->failures < breaker_threshold)
+        return;
+
+    if (!breaker->open)
+        printk(KERN_WARNING "Battery module: Battery %s is not responding, "
+                "serving the last known values\n", ctx->battery_name
+        );
+    WRITE_ONCE(breaker->open, true);
+    queue_delayed_work(system_freezable_wq, &ctx->breaker_work,
+            msecs_to_jiffies(breaker_cooldown_ms));
+}
+
+/** Record a successful refresh of the snapshot in the circuit breaker */
+static void battery_breaker_success(struct battery_context *ctx) {
+    struct battery_breaker *breaker = &ctx->breaker;
+
+    if (breaker->open)
+        printk(KERN_INFO "Battery module: Battery %s is responding again\n",
+                ctx->battery_name
+        );
+    breaker->failures = 0;
+    WRITE_ONCE(breaker->open, false);
+}
+
+/** Take a consistent copy of the cached snapshot without any lock */
+static void battery_snapshot_read(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot
+) {
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&ctx->snapshot_seqlock);
+        *snapshot = ctx->cache;
+    } while (read_seqretry(&ctx->snapshot_seqlock, seq));
+}
+
+/** Record an event and wake up all waiting readers */
+static void battery_event_add(
+    struct battery_context *ctx,
+    enum battery_event_type type,
+    unsigned int value,
+    unsigned int previous
+) {
+    struct battery_event event = {
+        .timestamp_ns = ktime_to_ns(ktime_get_boottime()),
+        .type = type,
+        .value = value,
+        .previous = previous
+    };
+
+    struct battery_events *events = &ctx->events;
+
+    spin_lock(&events->lock);
+    event.sequence = events->head;
+    events->events[events->head % BATTERY_EVENTS_SIZE] = event;
+    events->head++;
+    spin_unlock(&events->lock);
+
+    wake_up_interruptible(&events->wait);
+}
+
+/** Check, if a capacity level is low or critical, i.e. needs attention */
+static inline bool battery_capacity_level_alert(unsigned int level) {
+    return level == POWER_SUPPLY_CAPACITY_LEVEL_LOW ||
+        level == POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+}
+
+/** Check, if the capacity crossed one of the `capacity_thresholds` */
+static bool battery_capacity_crossed(
+    unsigned int capacity,
+    unsigned int previous
+) {
+    unsigned int i;
+
+    for (i = 0; i < capacity_thresholds_count; i++) {
+        const unsigned int threshold = capacity_thresholds[i];
+        if ((capacity < threshold) != (previous < threshold))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Record the events caused by a new snapshot compared to the published one.
+ *
+ * Stale snapshots do not contain new values and therefore never cause events.
+ * The caller has to hold the snapshot lock.
+ */
+static void battery_snapshot_events(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    const struct battery_snapshot *previous = &ctx->cache;
+
+    if (!snapshot->valid || snapshot->stale || !previous->valid)
+        return;
+
+    if (battery_register_value(snapshot, BATTERY_FIELD_STATUS) !=
+            battery_register_value(previous, BATTERY_FIELD_STATUS))
+        battery_event_add(ctx, BATTERY_EVENT_STATUS,
+                battery_register_value(snapshot, BATTERY_FIELD_STATUS),
+                battery_register_value(previous, BATTERY_FIELD_STATUS));
+    if (battery_capacity_crossed(snapshot->values.capacity,
+            previous->values.capacity))
+        battery_event_add(ctx, BATTERY_EVENT_CAPACITY,
+                snapshot->values.capacity, previous->values.capacity);
+    if (snapshot->values.capacity_level != previous->values.capacity_level &&
+            (battery_capacity_level_alert(snapshot->values.capacity_level) ||
+             battery_capacity_level_alert(previous->values.capacity_level)))
+        battery_event_add(ctx, BATTERY_EVENT_ALERT,
+                snapshot->values.capacity_level,
+                previous->values.capacity_level);
+}
+
+/**
+ * Schedule a uevent of the battery.
+ *
+ * The uevent is sent immediately, unless the last one was sent less than
+ * `uevent_interval_ms` ago. In that case it is delayed until the end of the
+ * interval. Further requests while a uevent is pending are merged into it.
+ *
+ * The caller has to hold the snapshot lock.
+ */
+static void battery_uevent_request(struct battery_context *ctx) {
+    const unsigned long now = jiffies;
+    const unsigned long next = ctx->uevent.timestamp +
+        msecs_to_jiffies(READ_ONCE(uevent_interval_ms));
+    unsigned long delay = 0;
+
+    if (!ctx->uevent.enabled)
+        return;
+    if (ctx->uevent.notified && time_before(now, next))
+        delay = next - now;
+    queue_delayed_work(system_freezable_wq, &ctx->uevent_work, delay);
+}
+
+/** Work sending a (coalesced) uevent of the battery */
+static void battery_uevent_notify(struct work_struct *work) {
+    struct battery_context *ctx =
+        container_of(to_delayed_work(work), struct battery_context, uevent_work);
+
+    mutex_lock(&ctx->snapshot_lock);
+    ctx->uevent.notified = true;
+    ctx->uevent.timestamp = jiffies;
+    mutex_unlock(&ctx->snapshot_lock);
+
+    power_supply_changed(ctx->battery);
+}
+
+/**
+ * Request a uevent of the battery, if a new snapshot differs meaningfully from
+ * the published one.
+ *
+ * The capacity is compared against the capacity at the last uevent, so that
+ * slow changes add up. The caller has to hold the snapshot lock.
+ */
+static void battery_snapshot_uevent(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    const struct battery_snapshot *previous = &ctx->cache;
+    const unsigned int capacity = snapshot->values.capacity;
+    const unsigned int delta = READ_ONCE(uevent_capacity_delta);
+    const unsigned int voltage_min = READ_ONCE(uevent_voltage_min_mv);
+
+    if (!snapshot->valid || snapshot->stale)
+        return;
+    if (!previous->valid) {
+        ctx->uevent.capacity = capacity;
+        return;
+    }
+
+    if (battery_register_value(snapshot, BATTERY_FIELD_STATUS) !=
+            battery_register_value(previous, BATTERY_FIELD_STATUS) ||
+        snapshot->values.capacity_level != previous->values.capacity_level ||
+        (delta && abs((int)capacity - (int)ctx->uevent.capacity) >= delta) ||
+        (snapshot->values.voltage < voltage_min) !=
+            (previous->values.voltage < voltage_min)) {
+        ctx->uevent.capacity = capacity;
+        battery_uevent_request(ctx);
+    }
+}
+
+/**
+ * Publish a new cached snapshot to the readers.
+ *
+ * The caller has to hold the snapshot lock.
+ */
+static void battery_snapshot_publish(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    battery_snapshot_events(ctx, snapshot);
+    battery_snapshot_uevent(ctx, snapshot);
+
+    write_seqlock(&ctx->snapshot_seqlock);
+    ctx->cache = *snapshot;
+    write_sequnlock(&ctx->snapshot_seqlock);
+}
+
+/**
+ * Refresh the cached snapshot and update the derived values.
+ *
+ * On failure the last good snapshot is kept, but marked as stale.
+ *
+ * The caller has to hold the snapshot lock. The function returns 0 on success
+ * and a negative error code otherwise.
+ */
+static int battery_snapshot_update(struct battery_context *ctx) {
+    struct battery_snapshot snapshot = ctx->cache;
+    int ret;
+
+    ret = battery_snapshot_refresh(ctx, &snapshot);
+    if (ret) {
+        snapshot = ctx->cache;
+        snapshot.stale = true;
+    } else {
+        battery_snapshot_evaluate(ctx, &snapshot);
+    }
+    battery_snapshot_publish(ctx, &snapshot);
+
+    /* only count the refresh after publishing it, see battery_snapshot_get() */
+    ctx->refresh.result = ret;
+    WRITE_ONCE(ctx->refresh.generation, ctx->refresh.generation + 1);
+
+    if (ret)
+        battery_breaker_failure(ctx);
+    else
+        battery_breaker_success(ctx);
+    return ret;
+}
+
+/**
+ * Get a copy of the current battery snapshot.
+ *
+ * The cached snapshot is used, if it is still fresh (see
+ * `battery_snapshot_fresh()`). This does not take any lock nor access the bus.
+ * Otherwise the registers are read again and the cache (including the derived
+ * values) is updated. While the circuit breaker is open, the bus is not
+ * accessed and the cached snapshot is used as well.
+ *
+ * Concurrent refreshes are coalesced: only the first caller, that finds the
+ * snapshot outdated, reads the registers. All callers, that find it outdated
+ * during that refresh, wait for it and use its result.
+ *
+ * The function returns 0, if the snapshot contains valid values. They are
+ * marked as stale, if they could not be updated. If there are no valid values
+ * at all, a negative error code is returned.
+ */
+static int battery_snapshot_get(
+    struct battery_context *ctx,
+    struct battery_snapshot *snapshot
+) {
+    const unsigned long generation = READ_ONCE(ctx->refresh.generation);
+    int ret = -ENODATA;
+
+    battery_snapshot_read(ctx, snapshot);
+    if (battery_snapshot_fresh(snapshot) || READ_ONCE(ctx->breaker.open))
+        return snapshot->valid ? 0 : ret;
+
+    mutex_lock(&ctx->snapshot_lock);
+    if (ctx->refresh.generation == generation)
+        ret = battery_snapshot_update(ctx);
+    else
+        /* refreshed by somebody else, while waiting for the lock */
+        ret = ctx->refresh.result;
+    mutex_unlock(&ctx->snapshot_lock);
+    battery_snapshot_read(ctx, snapshot);
+
+    return snapshot->valid ? 0 : ret;
+}
+
+/**
+ * Probe the battery, while the circuit breaker is open.
+ *
+ * If the battery responds, the breaker is closed and the snapshot is updated.
+ * Otherwise the breaker stays open and the battery is probed again after
+ * another cooldown period.
+ */
+static void battery_breaker_probe(struct work_struct *work) {
+    struct battery_context *ctx =
+        container_of(to_delayed_work(work), struct battery_context, breaker_work);
+
+    mutex_lock(&ctx->snapshot_lock);
+    battery_snapshot_update(ctx);
+    mutex_unlock(&ctx->snapshot_lock);
+}
+
+/**
+ * Invalidate the cached battery snapshot.
+ *
+ * The next property query will read the registers again. The values are kept,
+ * so that they can still be served while the battery does not respond.
+ */
+static void battery_snapshot_invalidate(struct battery_context *ctx) {
+    struct battery_snapshot snapshot;
+
+    mutex_lock(&ctx->snapshot_lock);
+    snapshot = ctx->cache;
+    snapshot.stale = true;
+    battery_snapshot_publish(ctx, &snapshot);
+    mutex_unlock(&ctx->snapshot_lock);
+}
+
+/**
+ * Read the state of the AC plug.
+ *
+ * The function returns 1 if the AC adapter is connected, 0 if it is not and a
+ * negative error code, if the AC adapter could not be read.
+ */
+static inline int ac_adapter_online(struct battery_context *ctx) {
+    struct ac_adapter_request request = {
+        .addr = ctx->ac_adapter_device->addr,
+        .reg = AC_ADAPTER_REGISTER
+    };
+    const ktime_t start = ktime_get();
+    s32 data;
+
+    if (battery_bus_acquire_urgent(ctx, &request)) {
+        data = request.value;
+    } else {
+        data = ec_smbus_read_byte_data(ctx->ac_adapter_device,
+                AC_ADAPTER_REGISTER);
+        battery_bus_release(ctx->bus, NULL, false);
+    }
+    latency_histogram_add(&ctx->stats.ac_adapter_latency, start);
+
+    if (data < 0) {
+        atomic_inc(&ctx->stats.ac_adapter_failures);
+        return data;
+    }
+    return data & 0x10 ? 1 : 0;
+}
+
+
+/**
+ * Query a property from the battery snapshot.
+ *
+ * The function returns 0 on success, -EINVAL for unknown properties and
+ * another negative error code, if there are no battery values at all.
+ */
+static int battery_get_snapshot_property(
+    struct battery_context *ctx,
     enum power_supply_property property,
     union power_supply_propval *val
 ) {
+    struct battery_snapshot snapshot;
+    int ret;
+
+    ret = battery_snapshot_get(ctx, &snapshot);
+    if (ret)
+        return ret;
+
     switch (property) {
     case POWER_SUPPLY_PROP_CAPACITY:
-        val->intval = battery_capacity();
+        val->intval = snapshot.values.capacity;
         break;
     case POWER_SUPPLY_PROP_STATUS:
-        val->intval = battery_status();
+        val->intval = snapshot.values.status;
         break;
     case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
-        val->intval = battery_time_to_empty();
+        val->intval = snapshot.values.time_to_empty;
         break;
     case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
-        val->intval = battery_time_to_full();
+        val->intval = snapshot.values.time_to_full;
         break;
     case POWER_SUPPLY_PROP_VOLTAGE_NOW:
-        val->intval = battery_voltage();
+        val->intval = snapshot.values.voltage;
         break;
     case POWER_SUPPLY_PROP_CURRENT_NOW:
-        val->intval = battery_current();
+        val->intval = snapshot.values.current_now;
         break;
     case POWER_SUPPLY_PROP_ENERGY_FULL:
         /* we calculate in mW, but the value is assumed to be in uW */
-        val->intval = battery_energy_full() * 1000;
+        val->intval = snapshot.values.energy_full * 1000;
         break;
     case POWER_SUPPLY_PROP_ENERGY_NOW:
         /* we calculate in mW, but the value is assumed to be in uW */
-        val->intval = battery_energy() * 1000;
+        val->intval = snapshot.values.energy * 1000;
         break;
     case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
-        val->intval = battery_capaity_level();
+        val->intval = snapshot.values.capacity_level;
         break;
+
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Query a property from the battery without recording statistics.
+ *
+ * Constant properties are answered without looking at the snapshot at all.
+ */
+static int battery_query_property(
+    struct battery_context *ctx,
+    enum power_supply_property property,
+    union power_supply_propval *val
+) {
+    switch (property) {
     case POWER_SUPPLY_PROP_ENERGY_FULL_DESIGN:
         /* always report the last full capacity (we have no designed value) */
         val->intval = BATTERY_DEFAULT_FULL_ENERGY * 1000;
@@ -414,108 +2500,1317 @@ static int battery_get_property(
         val->intval = BATTERY_DEFAULT_FULL_ENERGY * 25;
         break;
 
-    case POWER_SUPPLY_PROP_PRESENT:
-        val->intval = 1;
-        break;
-    case POWER_SUPPLY_PROP_TECHNOLOGY:
-        val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
-        break;
-    case POWER_SUPPLY_PROP_MANUFACTURER:
-        val->strval = "Acer";
-        break;
-    case POWER_SUPPLY_PROP_MODEL_NAME:
-        val->strval = "Acer Switch 11 Battery by jfrimmel";
-        break;
+    case POWER_SUPPLY_PROP_PRESENT:
+        val->intval = 1;
+        break;
+    case POWER_SUPPLY_PROP_TECHNOLOGY:
+        val->intval = POWER_SUPPLY_TECHNOLOGY_LION;
+        break;
+    case POWER_SUPPLY_PROP_MANUFACTURER:
+        val->strval = "Acer";
+        break;
+    case POWER_SUPPLY_PROP_MODEL_NAME:
+        val->strval = "Acer Switch 11 Battery by jfrimmel";
+        break;
+
+    default:
+        return battery_get_snapshot_property(ctx, property, val);
+    }
+    return 0;
+}
+
+/**
+ * Query a property from the battery.
+ *
+ * The function is called by the kernel, if any information from the driver is
+ * required.
+ *
+ * The function is currently designed in a way, that the "battery information"
+ * (see ACPI documentation) is taken from the cached register snapshot, which is
+ * only re-read from the battery, if it is too old. The relevant data is the
+ * used inside the function. The number of calls and the latency of every
+ * query are recorded in the debugfs statistics and every query is traced (the
+ * value of string properties is traced as 0).
+ *
+ * The function returns 0 (success) on every known property, otherwise the
+ * negative value of the "invalid value" error is returned (negative, since the
+ * function is a callback, that should return a negative number on failure). If
+ * the battery never responded, the "no data" error is returned instead of bogus
+ * values.
+ */
+static int battery_get_property(
+    struct power_supply *supply,
+    enum power_supply_property property,
+    union power_supply_propval *val
+) {
+    struct battery_context *ctx = power_supply_get_drvdata(supply);
+    const ktime_t start = ktime_get();
+    unsigned int i;
+    int ret;
+
+    trace_battery_property_enter(property);
+    ret = battery_query_property(ctx, property, val);
+    trace_battery_property_exit(property,
+            ret || property == POWER_SUPPLY_PROP_MANUFACTURER ||
+                property == POWER_SUPPLY_PROP_MODEL_NAME ? 0 : val->intval,
+            ret);
+
+    for (i = 0; i < ARRAY_SIZE(battery_properties); i++)
+        if (battery_properties[i] == property)
+            atomic_long_inc(&ctx->stats.properties[i]);
+    latency_histogram_add(&ctx->stats.property_latency, start);
+    return ret;
+}
+
+/** Query a property of the AC adapter. */
+static int ac_adapter_get_property(
+    struct power_supply *supply,
+    enum power_supply_property property,
+    union power_supply_propval *val
+) {
+    const struct battery_context *ctx = power_supply_get_drvdata(supply);
+
+    switch (property) {
+    case POWER_SUPPLY_PROP_ONLINE:
+        val->intval = READ_ONCE(ctx->ac_adapter_state.connected);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Work for periodical updates of the AC state.
+ *
+ * The work re-schedules itself with an adaptive interval: after a change of the
+ * state, the AC adapter is sampled fast, while the interval is doubled up to
+ * `ac_poll_max_ms` as long as the state is stable. If the AC adapter GPIO
+ * interrupt is used, the work is triggered by it and the maximum interval is
+ * used throughout. The work runs on a freezable workqueue, so it is not executed
+ * during suspend. A failed read is no change: the last state is kept and the
+ * read is retried with a backed-off interval.
+ */
+static void ac_adapter_updater(struct work_struct *work) {
+    struct battery_context *ctx = container_of(to_delayed_work(work),
+            struct battery_context, ac_adapter_work);
+    struct ac_adapter_state *state = &ctx->ac_adapter_state;
+    const int online = ac_adapter_online(ctx);
+
+    if (unlikely(online < 0)) {
+        state->interval_ms = clamp(2 * READ_ONCE(state->interval_ms),
+                ac_poll_min_ms, ac_poll_max_ms);
+    } else {
+        WRITE_ONCE(state->connected, online);
+        if (unlikely(online != state->last_state)) {
+            trace_battery_ac_adapter_changed(online);
+            if (state->last_state != -1)
+                battery_event_add(ctx, BATTERY_EVENT_AC_ADAPTER, online,
+                        state->last_state);
+            /* the battery values depend on the AC state */
+            battery_snapshot_invalidate(ctx);
+            power_supply_changed(ctx->ac_adapter);
+            state->interval_ms = ac_poll_min_ms;
+        }
+
+        if (state->irq >= 0) {
+            /* changes are signalled by the interrupt, this is a safety net */
+            state->interval_ms = ac_poll_max_ms;
+        } else if (online == state->last_state) {
+            state->interval_ms = clamp(2 * READ_ONCE(state->interval_ms),
+                    ac_poll_min_ms, ac_poll_max_ms);
+        }
+        state->last_state = online;
+    }
+
+    queue_delayed_work(system_freezable_wq, &ctx->ac_adapter_work,
+            max(msecs_to_jiffies(state->interval_ms), 1UL));
+}
+
+/**
+ * Sample the AC adapters of all batteries immediately and continue with the
+ * minimum poll interval (e.g. after the poll intervals changed)
+ */
+static void ac_adapters_restart(void) {
+    const unsigned int interval_ms = READ_ONCE(ac_poll_min_ms);
+    struct battery_context *ctx;
+
+    mutex_lock(&battery_contexts_lock);
+    list_for_each_entry(ctx, &battery_contexts, list) {
+        if (!READ_ONCE(ctx->sampler_enabled))
+            continue;
+        WRITE_ONCE(ctx->ac_adapter_state.interval_ms, interval_ms);
+        mod_delayed_work(system_freezable_wq, &ctx->ac_adapter_work, 0);
+    }
+    mutex_unlock(&battery_contexts_lock);
+}
+
+/** Interrupt handler of the AC adapter GPIO: update the AC state immediately */
+static irqreturn_t ac_adapter_interrupt(int irq, void *data) {
+    struct battery_context *ctx = data;
+
+    mod_delayed_work(system_freezable_wq, &ctx->ac_adapter_work, 0);
+    return IRQ_HANDLED;
+}
+
+/**
+ * Request the interrupt of the AC adapter GPIO, if one is configured.
+ *
+ * Failing to do so is not fatal, since the AC adapter state is polled in that
+ * case.
+ */
+static void ac_adapter_request_irq(struct battery_context *ctx) {
+    struct ac_adapter_state *state = &ctx->ac_adapter_state;
+    int irq;
+
+    if (!gpio_is_valid(state->gpio))
+        return;
+
+    if (gpio_request_one(state->gpio, GPIOF_IN, ctx->ac_adapter_name))
+        goto gpio_request_failed;
+
+    irq = gpio_to_irq(state->gpio);
+    if (irq < 0) goto irq_not_available;
+
+    if (request_irq(irq, ac_adapter_interrupt,
+            IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, ctx->ac_adapter_name,
+            ctx))
+        goto irq_not_available;
+
+    state->irq = irq;
+    return;
+
+irq_not_available:
+    gpio_free(state->gpio);
+gpio_request_failed:
+    printk(KERN_WARNING "Battery module: Interrupt of GPIO %d not available, "
+            "polling the AC adapter instead\n", state->gpio
+    );
+}
+
+/** Release the interrupt of the AC adapter GPIO, if it was requested */
+static void ac_adapter_free_irq(struct battery_context *ctx) {
+    struct ac_adapter_state *state = &ctx->ac_adapter_state;
+
+    if (state->irq < 0)
+        return;
+
+    free_irq(state->irq, ctx);
+    gpio_free(state->gpio);
+    state->irq = -1;
+}
+
+
+/** Record a snapshot as a new sample in the battery history */
+static void battery_history_add(
+    struct battery_context *ctx,
+    const struct battery_snapshot *snapshot
+) {
+    struct battery_history_sample sample = {
+        .timestamp_ns = ktime_to_ns(ktime_get_boottime()),
+        .energy = snapshot->values.energy,
+        .voltage = snapshot->values.voltage,
+        .current_now = snapshot->values.current_now,
+        .capacity = snapshot->values.capacity,
+        .status = snapshot->values.status,
+        .ac_online = snapshot->values.ac_online
+    };
+
+    struct battery_history *history = &ctx->history;
+    u32 head;
+
+    spin_lock(&history->lock);
+    head = history->header->data_head;
+    sample.sequence = head;
+    /*
+     * Mapped readers detect an overwritten sample by re-reading the head after
+     * the copy: the head has to be visible before the slot is overwritten and
+     * the sample has to be complete before the head is moved past it.
+     */
+    smp_wmb();
+    history->samples[head % BATTERY_HISTORY_SIZE] = sample;
+    smp_store_release(&history->header->data_head, head + 1);
+    spin_unlock(&history->lock);
+}
 
-    default:
-        return -EINVAL;
+/**
+ * Work for periodical samples of the battery history.
+ *
+ * The sample is based on the cached snapshot, i.e. only the outdated registers
+ * are read. The work re-schedules itself every `sampler_interval_ms`, or every
+ * `sampler_low_interval_ms` if the battery is low and not charging. It runs on
+ * a freezable workqueue, so it is not executed during suspend.
+ */
+static void battery_sampler(struct work_struct *work) {
+    struct battery_context *ctx =
+        container_of(to_delayed_work(work), struct battery_context, sampler_work);
+    unsigned int interval_ms = READ_ONCE(sampler_interval_ms);
+    struct battery_snapshot snapshot;
+
+    if (!battery_snapshot_get(ctx, &snapshot)) {
+        const unsigned int low_interval_ms = READ_ONCE(sampler_low_interval_ms);
+
+        battery_history_add(ctx, &snapshot);
+        if (low_interval_ms &&
+                battery_capacity_level_alert(snapshot.values.capacity_level) &&
+                snapshot.values.status != POWER_SUPPLY_STATUS_CHARGING)
+            interval_ms = min(interval_ms, low_interval_ms);
+    }
+
+    /*
+     * Regular samples need no precise timing, so they are aligned to full
+     * seconds to be batched with other timers, which saves wakeups.
+     */
+    if (interval_ms >= MSEC_PER_SEC)
+        queue_delayed_work(system_freezable_wq, &ctx->sampler_work,
+                round_jiffies_relative(msecs_to_jiffies(interval_ms)));
+    else if (interval_ms)
+        queue_delayed_work(system_freezable_wq, &ctx->sampler_work,
+                msecs_to_jiffies(interval_ms));
+}
+
+/**
+ * Restart the samplers of all batteries immediately (e.g. with a new interval).
+ *
+ * If the sampler is disabled, the pending samples are cancelled instead.
+ */
+static void battery_samplers_restart(void) {
+    const unsigned int interval_ms = READ_ONCE(sampler_interval_ms);
+    struct battery_context *ctx;
+
+    mutex_lock(&battery_contexts_lock);
+    list_for_each_entry(ctx, &battery_contexts, list) {
+        if (!READ_ONCE(ctx->sampler_enabled))
+            continue;
+        if (interval_ms)
+            mod_delayed_work(system_freezable_wq, &ctx->sampler_work, 0);
+        else
+            cancel_delayed_work(&ctx->sampler_work);
+    }
+    mutex_unlock(&battery_contexts_lock);
+}
+
+/** Change the sampler interval and (re-)start or stop the samplers immediately */
+static int sampler_interval_set(const char *value, const struct kernel_param *kp) {
+    int ret = param_set_uint(value, kp);
+
+    if (!ret)
+        battery_samplers_restart();
+    return ret;
+}
+
+/** The number of samples copied at once from the history to userspace */
+#define BATTERY_HISTORY_CHUNK 8
+
+/**
+ * Read samples from the battery history.
+ *
+ * The file position is the sequence number of the next sample to read, so
+ * every reader reads all samples exactly once, beginning with the oldest sample
+ * in the history. If a reader is too slow, the samples overwritten in the
+ * meantime are skipped. Only whole samples are returned and the read does not
+ * block: if there is no new sample, 0 is returned. Like the head of the
+ * history, the position wraps around after 2^32 samples.
+ */
+static ssize_t battery_history_read(
+    struct file *file,
+    char __user *buf,
+    size_t count,
+    loff_t *ppos
+) {
+    struct battery_context *ctx = file->private_data;
+    struct battery_history *history = &ctx->history;
+    struct battery_history_sample chunk[BATTERY_HISTORY_CHUNK];
+    size_t copied = 0;
+
+    if (battery_context_removed(ctx))
+        return -ENODEV;
+
+    while (count - copied >= sizeof(chunk[0])) {
+        const size_t wanted = (count - copied) / sizeof(chunk[0]);
+        u32 next = *ppos;
+        u32 head;
+        unsigned int n = 0;
+
+        spin_lock(&history->lock);
+        head = history->header->data_head;
+        if (head - next > BATTERY_HISTORY_SIZE)
+            next = head - BATTERY_HISTORY_SIZE;
+        while (n < BATTERY_HISTORY_CHUNK && n < wanted && next != head)
+            chunk[n++] = history->samples[next++ % BATTERY_HISTORY_SIZE];
+        spin_unlock(&history->lock);
+
+        if (!n)
+            break;
+        if (copy_to_user(buf + copied, chunk, n * sizeof(chunk[0])))
+            return copied ? copied : -EFAULT;
+        copied += n * sizeof(chunk[0]);
+        *ppos = next;
     }
+    return copied;
+}
+
+/**
+ * Map the battery history to userspace.
+ *
+ * Only the whole history (header and samples) can be mapped and only
+ * read-only, since the module is the only writer. This allows monitoring
+ * daemons to consume the samples without any system call or copy. A mapping
+ * keeps the file open, so the history stays allocated as long as it is mapped.
+ */
+static int battery_history_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct battery_context *ctx = file->private_data;
+
+    if (battery_context_removed(ctx))
+        return -ENODEV;
+    if (vma->vm_pgoff ||
+            vma->vm_end - vma->vm_start != BATTERY_HISTORY_MAPPING_SIZE)
+        return -EINVAL;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    return remap_vmalloc_range(vma, ctx->history.header, 0);
+}
+
+/** Allocate the battery history and initialize its header */
+static int battery_history_init(struct battery_history *history) {
+    history->header = vmalloc_user(BATTERY_HISTORY_MAPPING_SIZE);
+    if (!history->header)
+        return -ENOMEM;
+
+    history->header->version = BATTERY_HISTORY_VERSION;
+    history->header->sample_size = sizeof(struct battery_history_sample);
+    history->header->size = BATTERY_HISTORY_SIZE;
+    history->header->data_offset = PAGE_SIZE;
+    history->samples = (void *)history->header + PAGE_SIZE;
+    spin_lock_init(&history->lock);
     return 0;
 }
 
-/** Query a property of the AC adapter. */
-static int ac_adapter_get_property(
-    struct power_supply *supply,
-    enum power_supply_property property,
-    union power_supply_propval *val
+/**
+ * Open a character device of a battery.
+ *
+ * The file takes a reference of the context, which is its private data from
+ * then on. Opening does not race with the removal of the battery, since the
+ * misc core serializes the open with the deregistration of the device.
+ */
+static int battery_device_open(
+    struct battery_context *ctx,
+    struct inode *inode,
+    struct file *file
 ) {
-    switch (property) {
-    case POWER_SUPPLY_PROP_ONLINE:
-        val->intval = ac_adapter_connected;
-        break;
+    int ret = nonseekable_open(inode, file);
 
-    default:
+    if (ret) return ret;
+    kref_get(&ctx->kref);
+    file->private_data = ctx;
+    return 0;
+}
+
+/** Release a character device of a battery and its reference of the context */
+static int battery_device_release(struct inode *inode, struct file *file) {
+    battery_context_put(file->private_data);
+    return 0;
+}
+
+/** Open the battery history device */
+static int battery_history_open(struct inode *inode, struct file *file) {
+    return battery_device_open(container_of(file->private_data,
+            struct battery_context, history_device), inode, file);
+}
+
+/** The file operations of the battery history device */
+static const struct file_operations battery_history_fops = {
+    .owner = THIS_MODULE,
+    .open = battery_history_open,
+    .release = battery_device_release,
+    .read = battery_history_read,
+    .mmap = battery_history_mmap,
+    .llseek = no_llseek
+};
+
+
+/** Get the events of the battery of an open events device */
+static inline struct battery_events *battery_events_of(const struct file *file) {
+    struct battery_context *ctx = file->private_data;
+
+    return &ctx->events;
+}
+
+/** Open the battery events device: only events from now on are returned */
+static int battery_events_open(struct inode *inode, struct file *file) {
+    struct battery_events *events;
+    int ret = battery_device_open(container_of(file->private_data,
+            struct battery_context, events_device), inode, file);
+
+    if (!ret) {
+        events = battery_events_of(file);
+        spin_lock(&events->lock);
+        file->f_pos = events->head;
+        spin_unlock(&events->lock);
+    }
+    return ret;
+}
+
+/**
+ * Check, if there are events, which were not read from the file yet, or the
+ * battery was removed (i.e. there won't be any events anymore)
+ */
+static bool battery_events_pending(const struct file *file) {
+    struct battery_context *ctx = file->private_data;
+    struct battery_events *events = &ctx->events;
+    bool pending;
+
+    spin_lock(&events->lock);
+    pending = events->head != file->f_pos || ctx->removed;
+    spin_unlock(&events->lock);
+    return pending;
+}
+
+/**
+ * Read events from the battery events device.
+ *
+ * The file position is the sequence number of the next event to read. If a
+ * reader is too slow, the events overwritten in the meantime are skipped. Only
+ * whole events are returned. If there is no new event, the read blocks until
+ * there is one, unless the file was opened with O_NONBLOCK. Once the battery is
+ * removed, the read fails with -ENODEV.
+ */
+static ssize_t battery_events_read(
+    struct file *file,
+    char __user *buf,
+    size_t count,
+    loff_t *ppos
+) {
+    struct battery_events *events = battery_events_of(file);
+    struct battery_event chunk[BATTERY_HISTORY_CHUNK];
+    size_t copied = 0;
+
+    if (count < sizeof(chunk[0]))
         return -EINVAL;
+
+    while (!battery_events_pending(file)) {
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(events->wait,
+                battery_events_pending(file)))
+            return -ERESTARTSYS;
     }
-    return 0;
+    if (battery_context_removed(file->private_data))
+        return -ENODEV;
+
+    while (count - copied >= sizeof(chunk[0])) {
+        const size_t wanted = (count - copied) / sizeof(chunk[0]);
+        u64 next = *ppos;
+        u64 head;
+        unsigned int n = 0;
+
+        spin_lock(&events->lock);
+        head = events->head;
+        if (head - next > BATTERY_EVENTS_SIZE)
+            next = head - BATTERY_EVENTS_SIZE;
+        while (n < BATTERY_HISTORY_CHUNK && n < wanted && next < head)
+            chunk[n++] = events->events[next++ % BATTERY_EVENTS_SIZE];
+        spin_unlock(&events->lock);
+
+        if (!n)
+            break;
+        if (copy_to_user(buf + copied, chunk, n * sizeof(chunk[0])))
+            return copied ? copied : -EFAULT;
+        copied += n * sizeof(chunk[0]);
+        *ppos = next;
+    }
+    return copied;
+}
+
+/** Poll the battery events device for new events or the battery removal */
+static __poll_t battery_events_poll(struct file *file, poll_table *wait) {
+    poll_wait(file, &battery_events_of(file)->wait, wait);
+    if (battery_context_removed(file->private_data))
+        return EPOLLHUP | EPOLLERR;
+    return battery_events_pending(file) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/** The file operations of the battery events device */
+static const struct file_operations battery_events_fops = {
+    .owner = THIS_MODULE,
+    .open = battery_events_open,
+    .release = battery_device_release,
+    .read = battery_events_read,
+    .poll = battery_events_poll,
+    .llseek = no_llseek
+};
+
+/**
+ * Register the character devices of a battery.
+ *
+ * The devices of the first battery are named as in `battery-module-uapi.h`,
+ * the ones of further batteries get the number of the instance appended.
+ */
+static int battery_devices_register(struct battery_context *ctx) {
+    int ret;
+
+    if (ctx->index) {
+        snprintf(ctx->history_name, sizeof(ctx->history_name), "%s%u",
+                BATTERY_HISTORY_DEVICE, ctx->index);
+        snprintf(ctx->events_name, sizeof(ctx->events_name), "%s%u",
+                BATTERY_EVENTS_DEVICE, ctx->index);
+    } else {
+        strscpy(ctx->history_name, BATTERY_HISTORY_DEVICE,
+                sizeof(ctx->history_name));
+        strscpy(ctx->events_name, BATTERY_EVENTS_DEVICE,
+                sizeof(ctx->events_name));
+    }
+
+    ctx->history_device.minor = MISC_DYNAMIC_MINOR;
+    ctx->history_device.name = ctx->history_name;
+    ctx->history_device.fops = &battery_history_fops;
+    ctx->history_device.mode = 0444;
+    ret = misc_register(&ctx->history_device);
+    if (ret) return ret;
+
+    ctx->events_device.minor = MISC_DYNAMIC_MINOR;
+    ctx->events_device.name = ctx->events_name;
+    ctx->events_device.fops = &battery_events_fops;
+    ctx->events_device.mode = 0444;
+    ret = misc_register(&ctx->events_device);
+    if (ret) misc_deregister(&ctx->history_device);
+    return ret;
+}
+
+/**
+ * Deregister the character devices of a battery.
+ *
+ * Files, that are still open, keep the context alive, but fail from now on. The
+ * blocked readers of the events are woken up for that.
+ */
+static void battery_devices_deregister(struct battery_context *ctx) {
+    misc_deregister(&ctx->events_device);
+    misc_deregister(&ctx->history_device);
+
+    spin_lock(&ctx->events.lock);
+    ctx->removed = true;
+    spin_unlock(&ctx->events.lock);
+    wake_up_interruptible_all(&ctx->events.wait);
+}
+
+
+/**
+ * Read the current battery snapshot from its binary sysfs attribute.
+ *
+ * The snapshot is taken once per read and served from the cache, so that all
+ * values are consistent and only outdated registers are read from the battery.
+ */
+static ssize_t battery_snapshot_attr_read(
+    struct file *file,
+    struct kobject *kobj,
+    struct bin_attribute *attr,
+    char *buf,
+    loff_t off,
+    size_t count
+) {
+    struct battery_context *ctx =
+        container_of(attr, struct battery_context, snapshot_attr);
+    struct battery_snapshot_dump dump = {
+        .version = BATTERY_SNAPSHOT_VERSION,
+        .size = sizeof(dump),
+        .registers_first = BATTERY_REGISTERS_FIRST,
+        .registers_count = BATTERY_REGISTERS_SIZE
+    };
+    struct battery_snapshot snapshot;
+    int ret;
+
+    BUILD_BUG_ON(BATTERY_REGISTERS_SIZE > BATTERY_SNAPSHOT_REGISTERS);
+
+    ret = battery_snapshot_get(ctx, &snapshot);
+    if (ret) return ret;
+
+    dump.age_ms = jiffies_to_msecs(jiffies - snapshot.timestamp);
+    dump.flags = snapshot.stale ? BATTERY_SNAPSHOT_STALE : 0;
+    dump.status = snapshot.values.status;
+    dump.energy = snapshot.values.energy;
+    dump.energy_full = snapshot.values.energy_full;
+    dump.voltage = snapshot.values.voltage;
+    dump.current_now = snapshot.values.current_now;
+    dump.rate = snapshot.values.rate;
+    dump.capacity = snapshot.values.capacity;
+    dump.capacity_level = snapshot.values.capacity_level;
+    dump.time_to_empty = snapshot.values.time_to_empty;
+    dump.time_to_full = snapshot.values.time_to_full;
+    dump.ac_online = snapshot.values.ac_online;
+    memcpy(dump.registers, snapshot.raw, sizeof(snapshot.raw));
+
+    return memory_read_from_buffer(buf, count, &off, &dump, sizeof(dump));
+}
+
+/**
+ * Initialize the attribute groups of the battery with the binary sysfs
+ * attribute containing the snapshot.
+ *
+ * The groups are passed to `power_supply_register()`, so that the attribute
+ * exists, when the battery is announced to userspace. The attribute is part of
+ * the context, so that its read knows the battery.
+ */
+static void battery_snapshot_attr_init(struct battery_context *ctx) {
+    struct bin_attribute *attr = &ctx->snapshot_attr;
+
+    sysfs_bin_attr_init(attr);
+    attr->attr.name = BATTERY_SNAPSHOT_ATTRIBUTE;
+    attr->attr.mode = 0444;
+    attr->size = sizeof(struct battery_snapshot_dump);
+    attr->read = battery_snapshot_attr_read;
+
+    ctx->battery_bin_attrs[0] = attr;
+    ctx->battery_group.bin_attrs = ctx->battery_bin_attrs;
+    ctx->battery_groups[0] = &ctx->battery_group;
 }
 
-/** Kernel thread for periodical updates of the AC state */
-static int ac_adapter_updater(void *params) {
-    unsigned int last_state = -1;
-    while (!kthread_should_stop()) {
-        ac_adapter_connected = ac_adapter_online();
-        if (unlikely(ac_adapter_connected != last_state))
-            power_supply_changed(ac_adapter);
-        last_state = ac_adapter_connected;
 
-        msleep_interruptible(AC_ADAPTER_CHECK_RATE_MS);
+/** Show the I2C statistics of every register, that was accessed at least once */
+static int battery_stats_registers_show(struct seq_file *file, void *data) {
+    const struct battery_stats *stats = file->private;
+    unsigned int reg;
+
+    seq_puts(file, "register transfers retries failures\n");
+    for (reg = 0; reg < ARRAY_SIZE(stats->registers); reg++) {
+        const long transfers =
+            atomic_long_read(&stats->registers[reg].transfers);
+        if (!transfers)
+            continue;
+        seq_printf(file, "0x%02X %ld %ld %ld\n", reg, transfers,
+                atomic_long_read(&stats->registers[reg].retries),
+                atomic_long_read(&stats->registers[reg].failures)
+        );
     }
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(battery_stats_registers);
+
+/** Show the number of queries of every battery property */
+static int battery_stats_properties_show(struct seq_file *file, void *data) {
+    const struct battery_stats *stats = file->private;
+    unsigned int i;
+
+    seq_puts(file, "property calls\n");
+    for (i = 0; i < ARRAY_SIZE(battery_properties); i++)
+        seq_printf(file, "%d %ld\n", battery_properties[i],
+                atomic_long_read(&stats->properties[i])
+        );
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(battery_stats_properties);
+
+/** Show a latency histogram, one line per bucket */
+static int latency_histogram_show(struct seq_file *file, void *data) {
+    const struct latency_histogram *histogram = file->private;
+    unsigned int bucket;
+
+    seq_puts(file, "from_us to_us count\n");
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        seq_printf(file, "%lu %lu %ld\n",
+                bucket ? 1UL << (bucket - 1) : 0, 1UL << bucket,
+                atomic_long_read(&histogram->buckets[bucket])
+        );
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency_histogram);
 
+/**
+ * Show the state of health of the battery.
+ *
+ * This is the learned full energy compared to the design energy, and the total
+ * energy throughput of the battery according to the energy integrator.
+ */
+static int battery_health_show(struct seq_file *file, void *data) {
+    struct battery_context *ctx = file->private;
+    unsigned int full;
+    u64 charged, discharged;
+    s64 integrated;
+
+    mutex_lock(&ctx->snapshot_lock);
+    full = battery_energy_full(ctx);
+    charged = ctx->integrator.charged;
+    discharged = ctx->integrator.discharged;
+    integrated = ctx->integrator.integrated;
+    mutex_unlock(&ctx->snapshot_lock);
+
+    seq_printf(file, "energy_full_mwh %u\n", full);
+    seq_printf(file, "energy_full_design_mwh %u\n", BATTERY_DEFAULT_FULL_ENERGY);
+    seq_printf(file, "health_percent %u\n",
+            DIV_ROUND_CLOSEST(full * 100, BATTERY_DEFAULT_FULL_ENERGY));
+    seq_printf(file, "charged_mwh %llu\n", div64_u64(charged, UW_MS_PER_MWH));
+    seq_printf(file, "discharged_mwh %llu\n",
+            div64_u64(discharged, UW_MS_PER_MWH));
+    seq_printf(file, "integrated_mwh %lld\n",
+            div64_s64(integrated, UW_MS_PER_MWH));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(battery_health);
 
 /**
- * Initialize the kernel module.
+ * Create the debugfs directory with the statistics of a battery.
  *
- * This function is called, if the module is loaded/inserted into the kernel.
- * It acquires or registers resources, such as an I2C slave (the battery) or the
- * power supply.
+ * The directory of the first battery is "acer-switch-battery", the ones of
+ * further batteries get the number of the instance appended. Every battery has
+ * its own emulated embedded controller, so every directory gets the "mock"
+ * directory of the controller of its battery. Errors are ignored, since the
+ * statistics are not required for the operation of the driver.
+ */
+static void battery_stats_init(struct battery_context *ctx) {
+    struct battery_stats *stats = &ctx->stats;
+    struct dentry *dir;
+    char name[32];
+
+    if (ctx->index)
+        snprintf(name, sizeof(name), "%s%u", BATTERY_DEVICE_TYPE, ctx->index);
+    else
+        strscpy(name, BATTERY_DEVICE_TYPE, sizeof(name));
+    dir = debugfs_create_dir(name, NULL);
+
+    debugfs_create_file("registers", 0444, dir, stats,
+            &battery_stats_registers_fops);
+    debugfs_create_file("properties", 0444, dir, stats,
+            &battery_stats_properties_fops);
+    debugfs_create_file("register_latency", 0444, dir,
+            &stats->register_latency, &latency_histogram_fops);
+    debugfs_create_file("property_latency", 0444, dir,
+            &stats->property_latency, &latency_histogram_fops);
+    debugfs_create_file("ac_adapter_latency", 0444, dir,
+            &stats->ac_adapter_latency, &latency_histogram_fops);
+    debugfs_create_atomic_t("ac_adapter_failures", 0444, dir,
+            &stats->ac_adapter_failures);
+    debugfs_create_file("health", 0444, dir, ctx, &battery_health_fops);
+    mock_ec_debugfs_init(dir, ctx->index);
+    stats->dir = dir;
+}
+
+
+/**
+ * Initialize the context of a battery, which was not bound before.
  *
- * The function returns 0 on success, -1 otherwise. Resources acquired during
- * the initialization phase are released in the case of an error.
+ * This only sets up the state of the context, nothing is registered yet.
  */
-static __init int battery_module_init(void) {
-    i2c_bus = i2c_get_adapter(I2C_BUS);
-    if (!i2c_bus) goto i2c_bus_adapter_not_available;
+static void battery_context_init(
+    struct battery_context *ctx,
+    struct i2c_client *client
+) {
+    ctx->battery_device = client;
+    ctx->burst_read_supported =
+        ec_check_functionality(client->adapter, I2C_FUNC_I2C);
+    snprintf(ctx->battery_name, sizeof(ctx->battery_name), BATTERY_NAME,
+            ctx->index);
+    snprintf(ctx->ac_adapter_name, sizeof(ctx->ac_adapter_name),
+            AC_ADAPTER_NAME, ctx->index);
+
+    mutex_init(&ctx->snapshot_lock);
+    seqlock_init(&ctx->snapshot_seqlock);
+    ctx->last_full_energy = BATTERY_DEFAULT_FULL_ENERGY;
+    spin_lock_init(&ctx->events.lock);
+    init_waitqueue_head(&ctx->events.wait);
+    ctx->ac_adapter_state.last_state = -1;
+    ctx->ac_adapter_state.gpio = ac_adapter_gpio[ctx->index];
+    ctx->ac_adapter_state.irq = -1;
+
+    INIT_DELAYED_WORK(&ctx->breaker_work, battery_breaker_probe);
+    INIT_DELAYED_WORK(&ctx->uevent_work, battery_uevent_notify);
+    INIT_DELAYED_WORK(&ctx->sampler_work, battery_sampler);
+    INIT_DELAYED_WORK(&ctx->ac_adapter_work, ac_adapter_updater);
+}
+
+/**
+ * Claim the number of a new battery instance.
+ *
+ * The preferred number is used, if it is still free, otherwise the lowest free
+ * one. The caller has to hold `battery_contexts_lock`. The function returns the
+ * number or -EBUSY, if all numbers are in use.
+ */
+static int battery_index_claim(const unsigned int preferred) {
+    unsigned long used = 0;
+    struct battery_context *ctx;
+
+    list_for_each_entry(ctx, &battery_contexts, list)
+        used |= BIT(ctx->index);
+
+    if (preferred < BATTERY_INSTANCES_MAX && !(used & BIT(preferred)))
+        return preferred;
+    if (used == BIT(BATTERY_INSTANCES_MAX) - 1)
+        return -EBUSY;
+    return ffz(used);
+}
+
+/**
+ * Bind the driver to a battery.
+ *
+ * This allocates the context of the battery and acquires or registers all its
+ * resources, such as the AC adapter, the power supplies and the character
+ * devices. The AC adapter is expected at the address of the layout of the
+ * battery, if it was instantiated by the module, otherwise at the default
+ * address. The battery itself is not accessed here: its registers are read
+ * when the first consumer asks for them, the AC adapter is sampled by its
+ * work, so probing does not wait for the embedded controller.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ * Resources acquired during the probe are released in the case of an error.
+ */
+static int battery_probe(
+    struct i2c_client *client,
+    const struct i2c_device_id *id
+) {
+    const struct battery_instance *instance = dev_get_platdata(&client->dev);
+    struct i2c_board_info ac_adapter_info = {
+        I2C_BOARD_INFO("acer-switch-AC", instance ?
+                instance->layout.ac_adapter_address : AC_ADAPTER_I2C_ADDRESS)
+    };
+    struct power_supply_config battery_config = {};
+    struct power_supply_config ac_adapter_config = {};
+    struct battery_context *ctx;
+    unsigned int interval_ms;
+    int ret = -ENODEV;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx) return -ENOMEM;
+    kref_init(&ctx->kref);
+
+    mutex_lock(&battery_contexts_lock);
+    ret = battery_index_claim(instance ? instance - battery_instances : 0);
+    if (ret >= 0) {
+        ctx->index = ret;
+        ctx->bus = battery_bus_get(client->adapter);
+        if (ctx->bus)
+            list_add_tail(&ctx->list, &battery_contexts);
+        else
+            ret = -ENOMEM;
+    }
+    mutex_unlock(&battery_contexts_lock);
+    if (ret < 0) goto index_claim_failed;
 
-    battery_device = i2c_new_device(i2c_bus, battery_info);
-    if (!battery_device) goto battery_device_creation_failed;
+    battery_context_init(ctx, client);
+    i2c_set_clientdata(client, ctx);
 
-    ac_adapter_device = i2c_new_device(i2c_bus, ac_adapter_info);
-    if (!ac_adapter_device) goto ac_adapter_device_creation_failed;
+    ctx->regmap = regmap_init(&client->dev, &battery_regmap_bus, ctx,
+            &battery_regmap_config);
+    if (IS_ERR(ctx->regmap)) {
+        ret = PTR_ERR(ctx->regmap);
+        goto battery_regmap_creation_failed;
+    }
 
-    battery = power_supply_register(
-        NULL,
-        &battery_description,
+    ret = -ENODEV;
+    ctx->ac_adapter_device = i2c_new_device(client->adapter, &ac_adapter_info);
+    if (!ctx->ac_adapter_device) goto ac_adapter_device_creation_failed;
+
+    ctx->battery_description = battery_description;
+    ctx->battery_description.name = ctx->battery_name;
+    battery_config.drv_data = ctx;
+    battery_snapshot_attr_init(ctx);
+    battery_config.attr_grp = ctx->battery_groups;
+    ctx->battery = power_supply_register(
+        &client->dev,
+        &ctx->battery_description,
         &battery_config
     );
-    if (!battery) goto battery_registration_failure;
+    if (IS_ERR(ctx->battery)) {
+        ret = PTR_ERR(ctx->battery);
+        goto battery_registration_failure;
+    }
 
-    ac_adapter = power_supply_register(
-        NULL,
-        &ac_adapter_description,
+    /*
+     * The battery is a "supplicant" of the AC adapter: if the AC adapter
+     * changes, all supplicants are also updated.
+     */
+    ctx->ac_adapter_description = ac_adapter_description;
+    ctx->ac_adapter_description.name = ctx->ac_adapter_name;
+    ctx->ac_adapter_to[0] = ctx->battery_name;
+    ac_adapter_config.drv_data = ctx;
+    ac_adapter_config.supplied_to = ctx->ac_adapter_to;
+    ac_adapter_config.num_supplicants = ARRAY_SIZE(ctx->ac_adapter_to);
+    ctx->ac_adapter = power_supply_register(
+        &client->dev,
+        &ctx->ac_adapter_description,
         &ac_adapter_config
     );
-    if (!ac_adapter) goto ac_adapter_registration_failure;
+    if (IS_ERR(ctx->ac_adapter)) {
+        ret = PTR_ERR(ctx->ac_adapter);
+        goto ac_adapter_registration_failure;
+    }
 
-    ac_adapter_thread = kthread_run(ac_adapter_updater, NULL, "AC update");
-    if (!ac_adapter_thread) goto thread_creation_failed;
+    ret = battery_history_init(&ctx->history);
+    if (ret) goto history_allocation_failure;
+    ret = battery_devices_register(ctx);
+    if (ret) goto devices_registration_failure;
+
+    mutex_lock(&ctx->snapshot_lock);
+    ctx->uevent.enabled = true;
+    mutex_unlock(&ctx->snapshot_lock);
+
+    battery_stats_init(ctx);
+    ac_adapter_request_irq(ctx);
+    queue_delayed_work(system_freezable_wq, &ctx->ac_adapter_work, 0);
+    WRITE_ONCE(ctx->sampler_enabled, true);
+    interval_ms = READ_ONCE(sampler_interval_ms);
+    if (interval_ms)
+        queue_delayed_work(system_freezable_wq, &ctx->sampler_work,
+                msecs_to_jiffies(interval_ms));
 
     return 0;
 
-thread_creation_failed:
-    power_supply_unregister(ac_adapter);
+devices_registration_failure:
+    /* the history is freed together with the context */
+history_allocation_failure:
+    power_supply_unregister(ctx->ac_adapter);
 ac_adapter_registration_failure:
-    power_supply_unregister(battery);
+    power_supply_unregister(ctx->battery);
+    /* the registration uevent may have queued a probe of the circuit breaker */
+    cancel_delayed_work_sync(&ctx->breaker_work);
 battery_registration_failure:
-    i2c_unregister_device(ac_adapter_device);
+    i2c_unregister_device(ctx->ac_adapter_device);
 ac_adapter_device_creation_failed:
-    i2c_unregister_device(battery_device);
-battery_device_creation_failed:
-    i2c_put_adapter(i2c_bus);
-i2c_bus_adapter_not_available:
-    return -1;
+    regmap_exit(ctx->regmap);
+battery_regmap_creation_failed:
+    mutex_lock(&battery_contexts_lock);
+    list_del(&ctx->list);
+    battery_bus_put(ctx->bus);
+    mutex_unlock(&battery_contexts_lock);
+index_claim_failed:
+    battery_context_put(ctx);
+    return ret;
+}
+
+/**
+ * Unbind the driver from a battery.
+ *
+ * This releases all resources acquired by `battery_probe()`. The context itself
+ * (incl. the history) is freed with the last open file of its devices.
+ */
+static int battery_remove(struct i2c_client *client) {
+    struct battery_context *ctx = i2c_get_clientdata(client);
+
+    mutex_lock(&battery_contexts_lock);
+    list_del(&ctx->list);
+    mutex_unlock(&battery_contexts_lock);
+
+    WRITE_ONCE(ctx->sampler_enabled, false);
+    cancel_delayed_work_sync(&ctx->sampler_work);
+    battery_devices_deregister(ctx);
+    debugfs_remove_recursive(ctx->stats.dir);
+    ac_adapter_free_irq(ctx);
+    cancel_delayed_work_sync(&ctx->ac_adapter_work);
+    mutex_lock(&ctx->snapshot_lock);
+    ctx->uevent.enabled = false;
+    mutex_unlock(&ctx->snapshot_lock);
+    cancel_delayed_work_sync(&ctx->uevent_work);
+    power_supply_unregister(ctx->ac_adapter);
+    power_supply_unregister(ctx->battery);
+    cancel_delayed_work_sync(&ctx->breaker_work);
+    i2c_unregister_device(ctx->ac_adapter_device);
+    regmap_exit(ctx->regmap);
+    mutex_lock(&battery_contexts_lock);
+    battery_bus_put(ctx->bus);
+    mutex_unlock(&battery_contexts_lock);
+    battery_context_put(ctx);
+    return 0;
+}
+
+/**
+ * Suspend a battery.
+ *
+ * All periodical work is stopped, so that the driver does not cause any bus
+ * traffic during suspend and resume. The cached snapshot is invalidated, since
+ * the battery changes while the system sleeps. The circuit breaker is closed,
+ * so that the first query after the resume reads the battery again.
+ */
+static int __maybe_unused battery_suspend(struct device *dev) {
+    struct battery_context *ctx = i2c_get_clientdata(to_i2c_client(dev));
+
+    WRITE_ONCE(ctx->sampler_enabled, false);
+    cancel_delayed_work_sync(&ctx->sampler_work);
+    cancel_delayed_work_sync(&ctx->ac_adapter_work);
+    cancel_delayed_work_sync(&ctx->breaker_work);
+
+    mutex_lock(&ctx->snapshot_lock);
+    ctx->breaker.failures = 0;
+    WRITE_ONCE(ctx->breaker.open, false);
+    mutex_unlock(&ctx->snapshot_lock);
+    battery_snapshot_invalidate(ctx);
+    return 0;
+}
+
+/**
+ * Resume a battery.
+ *
+ * The battery is not read here: the snapshot is refreshed lazily by the first
+ * query, which is shared by all concurrent queries (e.g. of upower waking up).
+ * Only the AC adapter is sampled once right away, since its state may have
+ * changed during the suspend, and the sampler is restarted with its regular
+ * interval.
+ */
+static int __maybe_unused battery_resume(struct device *dev) {
+    struct battery_context *ctx = i2c_get_clientdata(to_i2c_client(dev));
+    const unsigned int interval_ms = READ_ONCE(sampler_interval_ms);
+
+    queue_delayed_work(system_freezable_wq, &ctx->ac_adapter_work, 0);
+    WRITE_ONCE(ctx->sampler_enabled, true);
+    if (interval_ms)
+        queue_delayed_work(system_freezable_wq, &ctx->sampler_work,
+                msecs_to_jiffies(interval_ms));
+    return 0;
+}
+
+/** The power management operations of the battery */
+static SIMPLE_DEV_PM_OPS(battery_pm_ops, battery_suspend, battery_resume);
+
+/** The I2C devices handled by the driver */
+static const struct i2c_device_id battery_ids[] = {
+    { BATTERY_DEVICE_TYPE, 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(i2c, battery_ids);
+
+/**
+ * The I2C driver of the battery.
+ *
+ * The probe does not access the hardware, but registers some devices, so it is
+ * done asynchronously to keep it out of the critical path of the boot.
+ */
+static struct i2c_driver battery_driver = {
+    .driver = {
+        .name = BATTERY_DEVICE_TYPE,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+        .pm = &battery_pm_ops
+    },
+    .probe = battery_probe,
+    .remove = battery_remove,
+    .id_table = battery_ids
+};
+
+/**
+ * The I2C buses and addresses of the batteries and their AC adapters.
+ *
+ * One battery is instantiated per given bus. Addresses, which are not given,
+ * are taken from the layout of the hardware (or the default addresses).
+ * Without any bus, the layout of the hardware is used as is.
+ */
+static int i2c_bus[BATTERY_INSTANCES_MAX];
+static unsigned int i2c_bus_count;
+module_param_array(i2c_bus, int, &i2c_bus_count, 0444);
+MODULE_PARM_DESC(i2c_bus,
+    "I2C bus numbers of the batteries (default: from DMI, otherwise 1)");
+static unsigned short battery_address[BATTERY_INSTANCES_MAX];
+static unsigned int battery_address_count;
+module_param_array(battery_address, ushort, &battery_address_count, 0444);
+MODULE_PARM_DESC(battery_address,
+    "I2C addresses of the batteries (default: from DMI, otherwise 0x70)");
+static unsigned short ac_adapter_address[BATTERY_INSTANCES_MAX];
+static unsigned int ac_adapter_address_count;
+module_param_array(ac_adapter_address, ushort, &ac_adapter_address_count, 0444);
+MODULE_PARM_DESC(ac_adapter_address,
+    "I2C addresses of the AC adapters (default: from DMI, otherwise 0x30)");
+
+/**
+ * The layout of the Acer Switch 11.
+ *
+ * This is used for unknown hardware as well. Like every layout it is
+ * terminated by an entry without a battery address.
+ */
+static const struct battery_layout battery_switch_11_layout[] = {
+    {
+        .bus = I2C_BUS,
+        .battery_address = BATTERY_I2C_ADDRESS,
+        .ac_adapter_address = AC_ADAPTER_I2C_ADDRESS
+    },
+    { }
+};
+
+/**
+ * The hardware with a known layout of the batteries.
+ *
+ * Add an entry with the layout (see `battery_switch_11_layout`) to support
+ * another variant without any module parameter.
+ */
+static const struct dmi_system_id battery_dmi_table[] = {
+    {
+        .ident = "Acer Switch 11",
+        .matches = {
+            DMI_MATCH(DMI_SYS_VENDOR, "Acer"),
+            DMI_MATCH(DMI_PRODUCT_NAME, "Aspire SW5-111")
+        },
+        .driver_data = (void *)battery_switch_11_layout
+    },
+    { }
+};
+MODULE_DEVICE_TABLE(dmi, battery_dmi_table);
+
+/**
+ * Determine the batteries to instantiate.
+ *
+ * The layout is taken from the DMI table, then the buses and addresses given
+ * as module parameters are applied on top of it.
+ */
+static void battery_instances_init(void) {
+    const struct dmi_system_id *system = dmi_first_match(battery_dmi_table);
+    const struct battery_layout *layout =
+        system ? system->driver_data : battery_switch_11_layout;
+    unsigned int count, i;
+
+    for (count = 0; count < BATTERY_INSTANCES_MAX; count++) {
+        if (!layout[count].battery_address)
+            break;
+        battery_instances[count].layout = layout[count];
+    }
+
+    if (i2c_bus_count) {
+        for (i = 0; i < i2c_bus_count; i++) {
+            if (i >= count) {
+                battery_instances[i].layout.battery_address =
+                    BATTERY_I2C_ADDRESS;
+                battery_instances[i].layout.ac_adapter_address =
+                    AC_ADAPTER_I2C_ADDRESS;
+            }
+            battery_instances[i].layout.bus = i2c_bus[i];
+        }
+        count = i2c_bus_count;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i < battery_address_count)
+            battery_instances[i].layout.battery_address = battery_address[i];
+        if (i < ac_adapter_address_count)
+            battery_instances[i].layout.ac_adapter_address =
+                ac_adapter_address[i];
+    }
+    battery_instances_count = count;
+}
+
+/**
+ * Work instantiating the battery devices on the I2C buses.
+ *
+ * There is no firmware description of the batteries, so the module
+ * instantiates them, as soon as their I2C bus is available. If it is not
+ * (yet), the work is scheduled again by `battery_bus_notify()`, when a bus
+ * shows up. The bus is not held by the module: if it is removed, the I2C core
+ * removes the battery device as well and it is instantiated again, once the
+ * bus comes back.
+ */
+static void battery_instantiate(struct work_struct *work) {
+    unsigned int i;
+
+    mutex_lock(&battery_instances_lock);
+    for (i = 0; i < battery_instances_count; i++) {
+        struct battery_instance *instance = &battery_instances[i];
+        struct i2c_board_info info = {
+            I2C_BOARD_INFO(BATTERY_DEVICE_TYPE,
+                    instance->layout.battery_address),
+            .platform_data = instance
+        };
+        struct i2c_adapter *adapter;
+
+        if (instance->client)
+            continue;
+
+        adapter = i2c_get_adapter(instance->layout.bus);
+        if (!adapter)
+            continue;
+
+        instance->client = i2c_new_device(adapter, &info);
+        if (!instance->client)
+            printk(KERN_ERR "Battery module: Could not create the battery "
+                    "device 0x%02X on bus %d\n",
+                    instance->layout.battery_address, instance->layout.bus
+            );
+        i2c_put_adapter(adapter);
+    }
+    mutex_unlock(&battery_instances_lock);
+}
+
+/** Forget an instantiated battery device, which is removed by the I2C core */
+static void battery_instance_removed(const struct i2c_client *client) {
+    unsigned int i;
+
+    mutex_lock(&battery_instances_lock);
+    for (i = 0; i < battery_instances_count; i++)
+        if (battery_instances[i].client == client)
+            battery_instances[i].client = NULL;
+    mutex_unlock(&battery_instances_lock);
+}
+
+/** The work instantiating the battery devices */
+static DECLARE_WORK(battery_instantiate_work, battery_instantiate);
+
+/**
+ * Watch for new I2C buses and removed battery devices.
+ *
+ * If the I2C bus of a battery is registered after the module was loaded (or
+ * again after it was removed), the battery device is instantiated on it. If a
+ * battery device is removed (e.g. together with its bus), it is forgotten, so
+ * that it is neither unregistered twice nor keeps a new one from being created.
+ */
+static int battery_bus_notify(
+    struct notifier_block *notifier,
+    unsigned long action,
+    void *data
+) {
+    struct i2c_adapter *adapter;
+    struct i2c_client *client;
+    unsigned int i;
+
+    if (action == BUS_NOTIFY_DEL_DEVICE) {
+        client = i2c_verify_client(data);
+        if (client)
+            battery_instance_removed(client);
+        return NOTIFY_DONE;
+    }
+    if (action != BUS_NOTIFY_ADD_DEVICE)
+        return NOTIFY_DONE;
+
+    adapter = i2c_verify_adapter(data);
+    if (!adapter)
+        return NOTIFY_DONE;
+
+    for (i = 0; i < battery_instances_count; i++)
+        if (adapter->nr == battery_instances[i].layout.bus)
+            schedule_work(&battery_instantiate_work);
+    return NOTIFY_DONE;
+}
+
+/** The notifier for new I2C buses */
+static struct notifier_block battery_bus_notifier = {
+    .notifier_call = battery_bus_notify
+};
+
+/**
+ * Initialize the kernel module.
+ *
+ * This function is called, if the module is loaded/inserted into the kernel.
+ * It registers the driver and instantiates the battery devices in the
+ * background, so loading the module never waits for the I2C buses.
+ *
+ * The function returns 0 on success and a negative error code otherwise.
+ */
+static __init int battery_module_init(void) {
+    int ret;
+
+    battery_read_plan_check();
+#ifdef BATTERY_MOCK_EC
+    printk(KERN_WARNING "Battery module: Using the emulated embedded "
+            "controller instead of the hardware\n"
+    );
+#endif
+    battery_instances_init();
+
+    ret = i2c_add_driver(&battery_driver);
+    if (ret) goto driver_registration_failed;
+
+    ret = bus_register_notifier(&i2c_bus_type, &battery_bus_notifier);
+    if (ret) goto notifier_registration_failed;
+
+    schedule_work(&battery_instantiate_work);
+    return 0;
+
+notifier_registration_failed:
+    i2c_del_driver(&battery_driver);
+driver_registration_failed:
+    return ret;
 }
 
 /**
@@ -525,12 +3820,19 @@ i2c_bus_adapter_not_available:
  * resources.
  */
 static __exit void battery_module_exit(void) {
-    kthread_stop(ac_adapter_thread);
-    power_supply_unregister(ac_adapter);
-    power_supply_unregister(battery);
-    i2c_unregister_device(ac_adapter_device);
-    i2c_unregister_device(battery_device);
-    i2c_put_adapter(i2c_bus);
+    unsigned int i;
+
+    bus_unregister_notifier(&i2c_bus_type, &battery_bus_notifier);
+    cancel_work_sync(&battery_instantiate_work);
+    mutex_lock(&battery_instances_lock);
+    for (i = 0; i < battery_instances_count; i++) {
+        if (!battery_instances[i].client)
+            continue;
+        i2c_unregister_device(battery_instances[i].client);
+        battery_instances[i].client = NULL;
+    }
+    mutex_unlock(&battery_instances_lock);
+    i2c_del_driver(&battery_driver);
 }
 
 